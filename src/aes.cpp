@@ -1,6 +1,7 @@
 #include <iomanip>
 #include <algorithm>
 #include <cassert>
+#include <mutex>
 
 #include "aes.hpp"
 #include "utils.hpp"
@@ -36,13 +37,7 @@ static std::uint8_t gmul(std::uint8_t a, std::uint8_t b) {
     return p;
 }
 
-static void build_tables() {
-    static bool built_tables = false;
-    if (built_tables)
-        return;
-
-    built_tables = true;
-
+static void fill_tables() {
     // Build the S-box
     std::uint8_t p = 1, q = 1;
 
@@ -80,6 +75,12 @@ static void build_tables() {
     }
 }
 
+// Batches create AES instances on several threads at once, so the tables have to be filled exactly once, before any of them use them
+static void build_tables() {
+    static std::once_flag built_tables;
+    std::call_once(built_tables, fill_tables);
+}
+
 AES::AES(const std::uint8_t *key, const std::uint8_t *iv) {
     build_tables();
     expand_key(key);
@@ -0,0 +1,110 @@
+#include "cover_cache.hpp"
+#include "raw_layout.hpp"
+#include "sha256.hpp"
+
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+CoverCache::CoverCache(std::size_t budget) : budget(budget), used(0), hit_count(0), miss_count(0) {
+}
+
+bool CoverCache::load(const std::string &path, Image &image) {
+    std::error_code error;
+    auto absolute = fs::absolute(path, error).lexically_normal();
+    auto size     = error ? 0 : fs::file_size(path, error);
+    auto time     = error ? fs::file_time_type() : fs::last_write_time(path, error);
+
+    // Leave a file that can't be looked at for load() to report
+    if (error)
+        return image.load(path);
+
+    // A file that changed gets a new key, the old one is dropped once it is the least recently used
+    auto key = "file:" + absolute.string() + "\n" + std::to_string(size) + "\n" + std::to_string(time.time_since_epoch().count());
+    if (find(key, image))
+        return true;
+
+    auto decoded = std::make_unique<Image>();
+    if (!decoded->load(path))
+        return false;
+
+    if (!image.share(*decoded))
+        return image.load(path);
+
+    insert(key, std::move(decoded));
+
+    return true;
+}
+
+bool CoverCache::load(const std::uint8_t *data, std::size_t size, Image &image) {
+    RawLayout layout;
+    if (parse_raw_layout(data, size, false, layout))
+        return image.load(data, size);
+
+    std::uint8_t hash[32];
+    SHA256 sha;
+    sha.update(data, size);
+    sha.finish();
+    sha.get_hash(hash);
+
+    auto key = "data:" + std::string(reinterpret_cast<const char*>(hash), sizeof(hash));
+    if (find(key, image))
+        return true;
+
+    auto decoded = std::make_unique<Image>();
+    if (!decoded->load(data, size))
+        return false;
+
+    if (!image.share(*decoded))
+        return image.load(data, size);
+
+    insert(key, std::move(decoded));
+
+    return true;
+}
+
+std::size_t CoverCache::hits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hit_count;
+}
+
+std::size_t CoverCache::misses() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return miss_count;
+}
+
+bool CoverCache::find(const std::string &key, Image &image) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto found = index.find(key);
+    if (found == index.end() || !image.share(*found->second->image)) {
+        miss_count++;
+        return false;
+    }
+
+    entries.splice(entries.begin(), entries, found->second);
+    hit_count++;
+
+    return true;
+}
+
+void CoverCache::insert(const std::string &key, std::unique_ptr<Image> decoded) {
+    auto size = decoded->size();
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Another thread may have decoded the same cover in the meantime
+    if (size > budget || index.count(key))
+        return;
+
+    entries.push_front({key, std::move(decoded)});
+    index[key] = entries.begin();
+    used += size;
+
+    while (used > budget) {
+        auto &last = entries.back();
+        used -= last.image->size();
+        index.erase(last.key);
+        entries.pop_back();
+    }
+}
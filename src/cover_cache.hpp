@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "image.hpp"
+
+// Decoded covers kept in memory, so that encoding into a cover again skips decoding it. The images handed out share the
+// cached pixels until they are encoded into, and the least recently used covers are dropped to keep the pixels under
+// a budget. Safe to use from several threads at once.
+class CoverCache
+{
+public:
+    explicit CoverCache(std::size_t budget);
+
+    // Loads the image at a path, from the cache while the file's size and modification time stay the same
+    bool load(const std::string &path, Image &image);
+
+    // Loads an image held in memory, cached by the SHA-256 of its bytes. Uncompressed images are quicker to copy than to
+    // hash, so they aren't cached.
+    bool load(const std::uint8_t *data, std::size_t size, Image &image);
+
+    std::size_t hits() const;
+    std::size_t misses() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::unique_ptr<Image> image;
+    };
+
+    // Shares a cached image into image, and makes it the most recently used
+    bool find(const std::string &key, Image &image);
+
+    // Caches a decoded image, dropping the least recently used ones to make room
+    void insert(const std::string &key, std::unique_ptr<Image> decoded);
+
+    std::size_t budget, used;
+    std::size_t hit_count, miss_count;
+
+    std::list<Entry> entries; // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    mutable std::mutex mutex;
+};
@@ -0,0 +1,791 @@
+#include "deflate.hpp"
+#include "thread_pool.hpp"
+#include "zlib/zlib.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const std::size_t block_size = 128 * 1024;
+static const std::size_t dict_size  = 32 * 1024;
+
+// zlib header for a 32K window, with the level hint
+static void write_zlib_header(std::vector<std::uint8_t> &out, int level) {
+    int hint = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    int header = (0x78 << 8) | (hint << 6);
+    if (header % 31)
+        header += 31 - header % 31;
+
+    out.push_back(header >> 8);
+    out.push_back(header & 0xff);
+}
+
+static void write_adler32(std::vector<std::uint8_t> &out, uLong adler) {
+    out.push_back((adler >> 24) & 0xff);
+    out.push_back((adler >> 16) & 0xff);
+    out.push_back((adler >>  8) & 0xff);
+    out.push_back((adler >>  0) & 0xff);
+}
+
+// Deflates a single block into a raw deflate stream. All blocks but the last end on a byte boundary (sync flush),
+// so that the raw streams can simply be concatenated.
+static bool deflate_block(const std::uint8_t *data, std::size_t start, std::size_t end, bool last, int level, int strategy, std::vector<std::uint8_t> &out) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, strategy) != Z_OK)
+        return false;
+
+    // Prime the dictionary with the tail of the previous block
+    if (start) {
+        auto dict = std::min(start, dict_size);
+        if (deflateSetDictionary(&stream, data + start - dict, dict) != Z_OK) {
+            deflateEnd(&stream);
+            return false;
+        }
+    }
+
+    out.resize(deflateBound(&stream, end - start) + 16);
+
+    stream.next_in   = const_cast<Bytef*>(data + start);
+    stream.avail_in  = end - start;
+    stream.next_out  = out.data();
+    stream.avail_out = out.size();
+
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    deflateEnd(&stream);
+
+    if (result != (last ? Z_STREAM_END : Z_OK) || stream.avail_in)
+        return false;
+
+    out.resize(stream.total_out);
+    return true;
+}
+
+std::vector<std::uint8_t> parallel_deflate(const std::uint8_t *data, std::size_t size, int level, int strategy) {
+    auto count = std::max<std::size_t>(1, (size + block_size - 1) / block_size);
+
+    std::vector<std::vector<std::uint8_t>> blocks(count);
+    std::vector<uLong> adlers(count);
+    std::vector<char> ok(count);
+
+    ThreadPool::shared().parallel_for(count, [&](std::size_t i) {
+        auto start = i * block_size;
+        auto end   = std::min(size, start + block_size);
+
+        ok[i]     = deflate_block(data, start, end, i == count - 1, level, strategy, blocks[i]);
+        adlers[i] = adler32(1, data + start, end - start);
+    });
+
+    if (std::find(ok.begin(), ok.end(), 0) != ok.end())
+        return {};
+
+    // Combine the checksums of the blocks
+    auto adler = adlers[0];
+    for (std::size_t i = 1; i < count; i++)
+        adler = adler32_combine(adler, adlers[i], std::min(block_size, size - i * block_size));
+
+    std::size_t total = 6;
+    for (auto &block : blocks)
+        total += block.size();
+
+    std::vector<std::uint8_t> out;
+    out.reserve(total);
+
+    write_zlib_header(out, level);
+
+    for (auto &block : blocks)
+        out.insert(out.end(), block.begin(), block.end());
+
+    write_adler32(out, adler);
+
+    return out;
+}
+
+// In-tree deflate engine
+
+static const std::size_t window_size = 32768;
+static const unsigned int min_match  = 3;
+static const unsigned int max_match  = 258;
+static const unsigned int hash_bits  = 15;
+
+static const unsigned int num_litlen  = 288;
+static const unsigned int num_dist    = 32;
+static const unsigned int num_precode = 19;
+static const unsigned int end_of_block = 256;
+
+// Blocks end once this many bytes are in them, or earlier if the data changes
+static const std::size_t max_block_length = 300000;
+static const std::size_t min_block_length = 10000;
+
+static const std::uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const std::uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const std::uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const std::uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const std::uint8_t precode_order[num_precode] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Matchfinder settings for each level, much like zlib's
+static const struct {
+    unsigned int max_chain;   // How many earlier positions to try
+    unsigned int good_length; // Search a quarter as hard once a match is this long
+    unsigned int max_lazy;    // Check if the next position has a longer match for anything shorter, greedy if zero
+    unsigned int nice_length; // Stop searching once a match is this long
+    unsigned int max_insert;  // Greedy levels only remember the positions inside matches up to this long
+} engine_levels[10] = {
+    {   4,   4,   0,   8,   4}, // 0, treated as 1
+    {   4,   4,   0,   8,   4},
+    {   4,   5,   0,  16,   4},
+    {   4,   6,   0,  32,   4},
+    {   4,   4,  16,  16,   0},
+    {   8,  16,  32,  32,   0},
+    {  32,   8,  16, 128,   0},
+    {  64,   8,  32, 128,   0},
+    { 256,  32, 128, 258,   0},
+    {1024,  32, 258, 258,   0},
+};
+
+// A literal when length is zero, otherwise a match
+struct Item {
+    std::uint16_t length;
+    std::uint16_t value;
+};
+
+struct SymbolTables {
+    std::uint8_t length_symbol[max_match + 1]; // Length to length code index
+    std::uint8_t dist_symbol[512];             // Distance-1 (or (distance-1) >> 7 past 256) to distance code
+
+    SymbolTables() {
+        for (unsigned int code = 0; code < 29; code++)
+            for (unsigned int length = length_base[code]; length < length_base[code] + (1u << length_extra[code]) && length <= max_match; length++)
+                length_symbol[length] = code;
+        length_symbol[max_match] = 28;
+
+        for (unsigned int code = 0; code < 30; code++) {
+            for (unsigned int dist = dist_base[code]; dist < dist_base[code] + (1u << dist_extra[code]); dist++) {
+                if (dist <= 256)
+                    dist_symbol[dist - 1] = code;
+                else
+                    dist_symbol[256 + ((dist - 1) >> 7)] = code;
+            }
+        }
+    }
+
+    unsigned int dist_code(unsigned int dist) const {
+        return dist <= 256 ? dist_symbol[dist - 1] : dist_symbol[256 + ((dist - 1) >> 7)];
+    }
+};
+
+static const SymbolTables tables;
+
+class BitWriter
+{
+public:
+    explicit BitWriter(std::vector<std::uint8_t> &out) : out(out), size(out.size()), bits(0), count(0) {}
+
+    // Makes room for at least this many more bytes, put() itself never checks
+    void reserve(std::size_t bytes) {
+        if (out.size() < size + bytes + 8)
+            out.resize(size + bytes + 8);
+    }
+
+    // Adds up to 16 bits
+    void put(std::uint32_t value, unsigned int n) {
+        bits  |= std::uint64_t(value) << count;
+        count += n;
+
+        if (count >= 32) {
+            out[size + 0] = bits;
+            out[size + 1] = bits >> 8;
+            out[size + 2] = bits >> 16;
+            out[size + 3] = bits >> 24;
+
+            size  += 4;
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+
+    // Pads to the next byte boundary
+    void align() {
+        for (; count; count = count > 8 ? count - 8 : 0) {
+            out[size++] = bits;
+            bits >>= 8;
+        }
+    }
+
+    void write_bytes(const std::uint8_t *data, std::size_t length) {
+        align();
+        std::copy_n(data, length, &out[size]);
+        size += length;
+    }
+
+    void finish() {
+        align();
+        out.resize(size);
+    }
+
+private:
+    std::vector<std::uint8_t> &out;
+    std::size_t size;
+    std::uint64_t bits;
+    unsigned int count;
+};
+
+// Builds Huffman code lengths no longer than max_length for the symbols with non-zero frequencies
+static void build_lengths(const std::uint32_t *freqs, unsigned int num, unsigned int max_length, std::uint8_t *lengths) {
+    std::fill_n(lengths, num, 0);
+
+    std::vector<unsigned int> symbols;
+    for (unsigned int i = 0; i < num; i++)
+        if (freqs[i])
+            symbols.push_back(i);
+
+    // A code needs at least two symbols to be complete
+    if (symbols.size() < 2) {
+        if (symbols.empty())
+            lengths[0] = lengths[1] = 1;
+        else
+            lengths[symbols[0]] = lengths[symbols[0] ? 0 : 1] = 1;
+        return;
+    }
+
+    // Build the tree, nodes past the leaves are internal
+    struct Node {
+        std::uint64_t freq;
+        int parent;
+    };
+    std::vector<Node> nodes;
+    for (auto symbol : symbols)
+        nodes.push_back({freqs[symbol], -1});
+
+    using Entry = std::pair<std::uint64_t, int>;
+    std::vector<Entry> heap;
+    for (std::size_t i = 0; i < nodes.size(); i++)
+        heap.emplace_back(nodes[i].freq, int(i));
+
+    auto greater = [](const Entry &a, const Entry &b) { return a > b; };
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    while (heap.size() > 1) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        auto a = heap.back(); heap.pop_back();
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        auto b = heap.back(); heap.pop_back();
+
+        int parent = nodes.size();
+        nodes.push_back({a.first + b.first, -1});
+        nodes[a.second].parent = parent;
+        nodes[b.second].parent = parent;
+
+        heap.emplace_back(a.first + b.first, parent);
+        std::push_heap(heap.begin(), heap.end(), greater);
+    }
+
+    // Count how many leaves are at each depth, anything too deep is squashed into max_length and then fixed up
+    unsigned int counts[33] = {};
+    for (std::size_t i = 0; i < symbols.size(); i++) {
+        unsigned int depth = 0;
+        for (int n = i; nodes[n].parent >= 0; n = nodes[n].parent)
+            depth++;
+
+        counts[std::min(depth, max_length)]++;
+    }
+
+    std::uint32_t total = 0;
+    for (unsigned int i = max_length; i > 0; i--)
+        total += counts[i] << (max_length - i);
+
+    while (total != (1u << max_length)) {
+        counts[max_length]--;
+        for (unsigned int i = max_length - 1; i > 0; i--) {
+            if (counts[i]) {
+                counts[i]--;
+                counts[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The most frequent symbols get the shortest codes
+    std::stable_sort(symbols.begin(), symbols.end(), [&](unsigned int a, unsigned int b) { return freqs[a] > freqs[b]; });
+
+    std::size_t next = 0;
+    for (unsigned int length = 1; length <= max_length; length++)
+        for (unsigned int i = 0; i < counts[length]; i++)
+            lengths[symbols[next++]] = length;
+}
+
+// Builds the canonical codes from the lengths, bit-reversed since deflate writes them starting from the top bit
+static void build_codes(const std::uint8_t *lengths, unsigned int num, std::uint16_t *codes) {
+    unsigned int counts[16] = {}, next[16] = {};
+    for (unsigned int i = 0; i < num; i++)
+        counts[lengths[i]]++;
+    counts[0] = 0;
+
+    unsigned int code = 0;
+    for (unsigned int bits = 1; bits < 16; bits++) {
+        code = (code + counts[bits - 1]) << 1;
+        next[bits] = code;
+    }
+
+    for (unsigned int i = 0; i < num; i++) {
+        unsigned int length = lengths[i];
+        if (!length)
+            continue;
+
+        unsigned int value = next[length]++, reversed = 0;
+        for (unsigned int b = 0; b < length; b++)
+            reversed |= ((value >> b) & 1) << (length - 1 - b);
+
+        codes[i] = reversed;
+    }
+}
+
+class BlockWriter
+{
+public:
+    explicit BlockWriter(BitWriter &writer) : writer(writer) {}
+
+    // Writes the items covering raw[0, raw_size) as whichever block type is the smallest
+    void write(const std::vector<Item> &items, const std::uint8_t *raw, std::size_t raw_size, bool final) {
+        std::uint32_t litlen_freqs[num_litlen] = {}, dist_freqs[num_dist] = {};
+        std::uint64_t extra_bits = 0;
+
+        for (auto &item : items) {
+            if (!item.length) {
+                litlen_freqs[item.value]++;
+                continue;
+            }
+
+            auto length_code = tables.length_symbol[item.length];
+            auto dist_code   = tables.dist_code(item.value);
+
+            litlen_freqs[257 + length_code]++;
+            dist_freqs[dist_code]++;
+            extra_bits += length_extra[length_code] + dist_extra[dist_code];
+        }
+        litlen_freqs[end_of_block]++;
+
+        // Every item takes at most 48 bits, and stored blocks add 5 bytes per 64K
+        writer.reserve(std::max(items.size() * 6, raw_size + (raw_size / 65535 + 1) * 5) + 1024);
+
+        // Dynamic Huffman
+        std::uint8_t litlen_lengths[num_litlen], dist_lengths[num_dist];
+        build_lengths(litlen_freqs, 286, 15, litlen_lengths);
+        build_lengths(dist_freqs, 30, 15, dist_lengths);
+        litlen_lengths[286] = litlen_lengths[287] = 0;
+        dist_lengths[30] = dist_lengths[31] = 0;
+
+        unsigned int hlit = 286, hdist = 30;
+        while (hlit > 257 && !litlen_lengths[hlit - 1])
+            hlit--;
+        while (hdist > 1 && !dist_lengths[hdist - 1])
+            hdist--;
+
+        // Run-length encode the code lengths with the precode
+        std::uint8_t all_lengths[num_litlen + num_dist];
+        std::copy_n(litlen_lengths, hlit, all_lengths);
+        std::copy_n(dist_lengths, hdist, all_lengths + hlit);
+
+        std::vector<std::pair<std::uint8_t, std::uint8_t>> precode_items; // Symbol and extra bits value
+        std::uint32_t precode_freqs[num_precode] = {};
+        encode_lengths(all_lengths, hlit + hdist, precode_items, precode_freqs);
+
+        std::uint8_t precode_lengths[num_precode];
+        build_lengths(precode_freqs, num_precode, 7, precode_lengths);
+
+        unsigned int hclen = num_precode;
+        while (hclen > 4 && !precode_lengths[precode_order[hclen - 1]])
+            hclen--;
+
+        std::uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + extra_bits;
+        for (auto &p : precode_items)
+            dynamic_bits += precode_lengths[p.first] + (p.first == 16 ? 2 : p.first == 17 ? 3 : p.first == 18 ? 7 : 0);
+        for (unsigned int i = 0; i < num_litlen; i++)
+            dynamic_bits += std::uint64_t(litlen_freqs[i]) * litlen_lengths[i];
+        for (unsigned int i = 0; i < num_dist; i++)
+            dynamic_bits += std::uint64_t(dist_freqs[i]) * dist_lengths[i];
+
+        // Static Huffman
+        std::uint8_t static_litlen[num_litlen], static_dist[num_dist];
+        std::fill_n(static_litlen,       144, 8);
+        std::fill_n(static_litlen + 144, 112, 9);
+        std::fill_n(static_litlen + 256,  24, 7);
+        std::fill_n(static_litlen + 280,   8, 8);
+        std::fill_n(static_dist, num_dist, 5);
+
+        std::uint64_t static_bits = 3 + extra_bits;
+        for (unsigned int i = 0; i < num_litlen; i++)
+            static_bits += std::uint64_t(litlen_freqs[i]) * static_litlen[i];
+        for (unsigned int i = 0; i < num_dist; i++)
+            static_bits += std::uint64_t(dist_freqs[i]) * static_dist[i];
+
+        // Stored, worst case alignment
+        std::size_t stored_blocks = std::max<std::size_t>(1, (raw_size + 65534) / 65535);
+        std::uint64_t stored_bits = stored_blocks * (3 + 7 + 32) + std::uint64_t(raw_size) * 8;
+
+        if (stored_bits <= dynamic_bits && stored_bits <= static_bits) {
+            write_stored(raw, raw_size, final);
+            return;
+        }
+
+        writer.put(final, 1);
+
+        if (static_bits <= dynamic_bits) {
+            writer.put(1, 2);
+            write_items(items, static_litlen, static_dist);
+            return;
+        }
+
+        writer.put(2, 2);
+        writer.put(hlit - 257, 5);
+        writer.put(hdist - 1, 5);
+        writer.put(hclen - 4, 4);
+
+        for (unsigned int i = 0; i < hclen; i++)
+            writer.put(precode_lengths[precode_order[i]], 3);
+
+        std::uint16_t precode_codes[num_precode];
+        build_codes(precode_lengths, num_precode, precode_codes);
+
+        for (auto &p : precode_items) {
+            writer.put(precode_codes[p.first], precode_lengths[p.first]);
+
+            if (p.first == 16)      writer.put(p.second, 2);
+            else if (p.first == 17) writer.put(p.second, 3);
+            else if (p.first == 18) writer.put(p.second, 7);
+        }
+
+        write_items(items, litlen_lengths, dist_lengths);
+    }
+
+private:
+    static void encode_lengths(const std::uint8_t *lengths, unsigned int num, std::vector<std::pair<std::uint8_t, std::uint8_t>> &out, std::uint32_t *freqs) {
+        for (unsigned int i = 0; i < num;) {
+            auto length = lengths[i];
+
+            unsigned int run = 1;
+            while (i + run < num && lengths[i + run] == length)
+                run++;
+
+            i += run;
+
+            if (!length) {
+                while (run >= 11) {
+                    auto n = std::min(run, 138u);
+                    out.emplace_back(18, n - 11);
+                    freqs[18]++;
+                    run -= n;
+                }
+                if (run >= 3) {
+                    out.emplace_back(17, run - 3);
+                    freqs[17]++;
+                    run = 0;
+                }
+            }
+            else if (run >= 4) {
+                out.emplace_back(length, 0);
+                freqs[length]++;
+                run--;
+
+                while (run >= 3) {
+                    auto n = std::min(run, 6u);
+                    out.emplace_back(16, n - 3);
+                    freqs[16]++;
+                    run -= n;
+                }
+            }
+
+            for (; run; run--) {
+                out.emplace_back(length, 0);
+                freqs[length]++;
+            }
+        }
+    }
+
+    void write_items(const std::vector<Item> &items, const std::uint8_t *litlen_lengths, const std::uint8_t *dist_lengths) {
+        std::uint16_t litlen_codes[num_litlen], dist_codes[num_dist];
+        build_codes(litlen_lengths, num_litlen, litlen_codes);
+        build_codes(dist_lengths, num_dist, dist_codes);
+
+        for (auto &item : items) {
+            if (!item.length) {
+                writer.put(litlen_codes[item.value], litlen_lengths[item.value]);
+                continue;
+            }
+
+            auto length_code = tables.length_symbol[item.length];
+            auto dist_code   = tables.dist_code(item.value);
+
+            writer.put(litlen_codes[257 + length_code], litlen_lengths[257 + length_code]);
+            writer.put(item.length - length_base[length_code], length_extra[length_code]);
+            writer.put(dist_codes[dist_code], dist_lengths[dist_code]);
+            writer.put(item.value - dist_base[dist_code], dist_extra[dist_code]);
+        }
+
+        writer.put(litlen_codes[end_of_block], litlen_lengths[end_of_block]);
+    }
+
+    void write_stored(const std::uint8_t *raw, std::size_t size, bool final) {
+        do {
+            auto length = std::min<std::size_t>(size, 65535);
+
+            writer.put(final && length == size, 1);
+            writer.put(0, 2);
+            writer.align();
+            writer.put(length, 16);
+            writer.put(~length & 0xffff, 16);
+            writer.write_bytes(raw, length);
+
+            raw  += length;
+            size -= length;
+        } while (size);
+    }
+
+    BitWriter &writer;
+};
+
+// Tracks how the mix of literals and matches changes, to find good places to end blocks
+class BlockSplitter
+{
+public:
+    BlockSplitter() { reset(); }
+
+    void reset() {
+        std::fill_n(observations, types, 0);
+        std::fill_n(new_observations, types, 0);
+        num_observations = num_new_observations = 0;
+    }
+
+    void literal(std::uint8_t value) {
+        new_observations[((value >> 5) & 0x6) | (value & 1)]++;
+        num_new_observations++;
+    }
+
+    void match(unsigned int length) {
+        new_observations[8 + (length >= 9)]++;
+        num_new_observations++;
+    }
+
+    // Checks every so often if the latest items look different enough from the rest of the block to start a new one
+    bool should_end(std::size_t block_length) {
+        if (num_new_observations < 512)
+            return false;
+
+        if (num_observations) {
+            std::uint64_t total_delta = 0;
+
+            for (unsigned int i = 0; i < types; i++) {
+                std::uint64_t expected = std::uint64_t(observations[i]) * num_new_observations;
+                std::uint64_t actual   = std::uint64_t(new_observations[i]) * num_observations;
+                total_delta += actual > expected ? actual - expected : expected - actual;
+            }
+
+            std::uint64_t cutoff = std::uint64_t(num_new_observations) * 200 / 512 * num_observations;
+
+            if (block_length - num_new_observations >= min_block_length &&
+                total_delta + (block_length / 4096) * std::uint64_t(num_observations) >= cutoff)
+                return true;
+        }
+
+        for (unsigned int i = 0; i < types; i++) {
+            observations[i] += new_observations[i];
+            new_observations[i] = 0;
+        }
+        num_observations += num_new_observations;
+        num_new_observations = 0;
+
+        return false;
+    }
+
+private:
+    static const unsigned int types = 10;
+
+    std::uint32_t observations[types], new_observations[types];
+    std::uint32_t num_observations, num_new_observations;
+};
+
+static unsigned int count_trailing_zeros(std::uint64_t value) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(value);
+#else
+    unsigned int count = 0;
+    for (; !(value & 1); value >>= 1)
+        count++;
+    return count;
+#endif
+}
+
+static std::uint32_t load_u32(const std::uint8_t *p) {
+    std::uint32_t value;
+    std::memcpy(&value, p, 4);
+    return value;
+}
+
+// How many bytes a and b have in common, up to limit (the 8 byte compare assumes little-endian)
+static unsigned int match_length(const std::uint8_t *a, const std::uint8_t *b, unsigned int limit) {
+    unsigned int length = 0;
+
+    for (; length + 8 <= limit; length += 8) {
+        std::uint64_t x, y;
+        std::memcpy(&x, a + length, 8);
+        std::memcpy(&y, b + length, 8);
+
+        if (x != y)
+            return length + count_trailing_zeros(x ^ y) / 8;
+    }
+
+    while (length < limit && a[length] == b[length])
+        length++;
+
+    return length;
+}
+
+static std::uint32_t hash3(const std::uint8_t *p) {
+    return ((load_u32(p) & 0xffffff) * 0x1e35a7bd) >> (32 - hash_bits);
+}
+
+std::vector<std::uint8_t> fast_deflate(const std::uint8_t *data, std::size_t size, int level) {
+    if (level < 0 || level > 9)
+        level = 6;
+    auto &settings = engine_levels[level];
+
+    std::vector<std::uint8_t> out;
+    write_zlib_header(out, level);
+
+    BitWriter bits(out);
+    BlockWriter blocks(bits);
+    BlockSplitter splitter;
+
+    // Hash chains of positions, only the low 32 bits are kept since anything further back than the window is useless.
+    // Every candidate is checked against the data, so stale entries just cost a compare.
+    std::vector<std::uint32_t> head(std::size_t(1) << hash_bits, 0x80000000u), prev(window_size, 0x80000000u);
+    std::size_t next_insert = 0;
+
+    auto insert_up_to = [&](std::size_t end) {
+        for (; next_insert < end && next_insert + 4 <= size; next_insert++) {
+            auto h = hash3(data + next_insert);
+            prev[next_insert & (window_size - 1)] = head[h];
+            head[h] = std::uint32_t(next_insert);
+        }
+        next_insert = std::max(next_insert, end);
+    };
+
+    // Finds the longest match for pos that beats best, returning its length (0 if none) and distance
+    auto find_match = [&](std::size_t pos, unsigned int best, unsigned int &best_dist) -> unsigned int {
+        if (pos + 4 > size)
+            return 0;
+
+        unsigned int limit = std::min<std::size_t>(max_match, size - pos);
+        unsigned int chain = best >= settings.good_length ? settings.max_chain / 4 : settings.max_chain;
+        unsigned int found = 0;
+        best = std::max(best, min_match - 1);
+
+        if (best >= limit)
+            return 0;
+
+        auto current = data + pos;
+        auto cur  = head[hash3(current)];
+        auto dist = std::uint32_t(pos) - cur;
+
+        while (dist && dist <= window_size && dist <= pos && chain--) {
+            auto candidate = current - dist;
+
+            if (candidate[best] == current[best] && !((load_u32(candidate) ^ load_u32(current)) & 0xffffff)) {
+                auto length = match_length(candidate, current, limit);
+
+                if (length > best) {
+                    best = found = length;
+                    best_dist = dist;
+
+                    if (length >= settings.nice_length || length == limit)
+                        break;
+                }
+            }
+
+            // Chains only ever go further back
+            auto next = prev[cur & (window_size - 1)];
+            auto next_dist = std::uint32_t(pos) - next;
+            if (next_dist <= dist)
+                break;
+
+            cur  = next;
+            dist = next_dist;
+        }
+
+        return found;
+    };
+
+    std::vector<Item> items;
+    items.reserve(max_block_length);
+    std::size_t block_start = 0;
+
+    auto end_block = [&](std::size_t end, bool final) {
+        blocks.write(items, data + block_start, end - block_start, final);
+        items.clear();
+        splitter.reset();
+        block_start = end;
+    };
+
+    std::size_t pos = 0;
+    while (pos < size) {
+        unsigned int dist = 0;
+        unsigned int length = find_match(pos, 0, dist);
+        insert_up_to(pos + 1);
+
+        // See if waiting a byte gives a longer match
+        while (length && length < settings.max_lazy && pos + 1 < size) {
+            unsigned int next_dist = 0;
+            unsigned int next_length = find_match(pos + 1, length, next_dist);
+            insert_up_to(pos + 2);
+
+            if (!next_length)
+                break;
+
+            items.push_back({0, data[pos]});
+            splitter.literal(data[pos]);
+            pos++;
+
+            length = next_length;
+            dist   = next_dist;
+        }
+
+        if (length) {
+            items.push_back({std::uint16_t(length), std::uint16_t(dist)});
+            splitter.match(length);
+
+            // Greedy levels don't bother remembering the insides of long matches
+            if (settings.max_lazy || length <= settings.max_insert)
+                insert_up_to(pos + length);
+            else
+                next_insert = pos + length;
+
+            pos += length;
+        }
+        else {
+            items.push_back({0, data[pos]});
+            splitter.literal(data[pos]);
+            pos++;
+        }
+
+        auto block_length = pos - block_start;
+        if (pos < size && (block_length >= max_block_length || splitter.should_end(block_length)))
+            end_block(pos, false);
+    }
+
+    end_block(size, true);
+    bits.finish();
+
+    write_adler32(out, adler32(1, data, size));
+
+    return out;
+}
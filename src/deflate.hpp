@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Compresses data into a single zlib stream. The data is split into blocks that are deflated in parallel,
+// each one primed with the last 32 KiB of the block before it, and then stitched back together.
+std::vector<std::uint8_t> parallel_deflate(const std::uint8_t *data, std::size_t size, int level, int strategy);
+
+// Compresses the whole buffer into a single zlib stream with the in-tree deflate engine. It keeps no streaming state,
+// uses a hash chain matchfinder (greedy at low levels, lazy at higher ones) and ends blocks where the statistics of the
+// data change, writing each block as stored, static or dynamic Huffman, whichever is the smallest.
+std::vector<std::uint8_t> fast_deflate(const std::uint8_t *data, std::size_t size, int level);
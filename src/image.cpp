@@ -1,36 +1,569 @@
 #include "image.hpp"
+#include "png.hpp"
+#include "qoi.hpp"
+#include "mapped_file.hpp"
 #include "stb/stb_image.h"
-#include "stb/stb_image_write.h"
+#include "zlib/zlib.h"
 
 #include <algorithm>
+#include <vector>
+#include <cstring>
+#include <filesystem>
+#include <cctype>
+#include <climits>
+#include <fstream>
 
-Image::Image() : width(0), height(0) {
+// The zlib level, zlib strategy and PNG filter (-1 tries all 5 per row) of each profile
+static const struct {
+    int level;
+    int strategy;
+    int filter;
+} png_profiles[3] = {
+    {1, Z_RLE,      4}, // Fast, always Paeth
+    {6, Z_FILTERED, -1}, // Balanced
+    {9, Z_FILTERED, -1}, // Small
+};
+
+Image::Image() : borrowed(false), width(0), height(0), channels(0), depth(8), layout(), loaded(0), full_rows(0), plane_bits(4), plane_size(0) {
+}
+
+Image::~Image() {
+}
+
+// How many low bits of each channel byte a level uses
+static unsigned int level_bits(Image::EncodingLevel level) {
+    return 8 / Image::encoded_size(1, level);
+}
+
+// Packs the low bits of 8 channel bytes together, the first byte ending up in the lowest bits (assumes little-endian)
+template <unsigned int bits> static std::uint32_t pack_low_bits(const std::uint8_t *in) {
+    std::uint64_t x;
+    std::memcpy(&x, in, 8);
+    x &= 0x0101010101010101ull * ((1u << bits) - 1);
+
+    // Every step moves each odd group down next to the even one before it, halving the number of groups
+    for (unsigned int group = 8, n = bits; group < 64; group *= 2, n *= 2) {
+        std::uint64_t keep = 0;
+        for (unsigned int i = 0; i < 64; i += group * 2)
+            keep |= ((std::uint64_t(1) << (n * 2)) - 1) << i;
+
+        x = (x | (x >> (group - n))) & keep;
+    }
+
+    return std::uint32_t(x);
+}
+
+// Ors up to 32 bits into data at a bit position
+static void put_bits(std::uint8_t *data, std::size_t pos, std::uint32_t value, unsigned int n) {
+    auto bits = std::uint64_t(value) << (pos % 8);
+    auto out  = data + pos / 8;
+
+    for (unsigned int i = 0; i < (pos % 8 + n + 7) / 8; i++)
+        out[i] |= std::uint8_t(bits >> (i * 8));
+}
+
+// The extension of a path in lower case, with its dot
+static std::string extension_of(const std::string &path) {
+    auto extension = std::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return std::tolower(c); });
+
+    return extension;
+}
+
+// QOI images are told apart by their magic, whatever their extension
+static bool starts_as_qoi(const std::string &path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+
+    std::uint8_t magic[4] = {};
+    file.read(reinterpret_cast<char*>(magic), sizeof(magic));
+
+    return is_qoi(magic, static_cast<std::size_t>(file.gcount()));
 }
 
 bool Image::load(const std::string &path) {
-    int x, y, n = 4;
+    if (!load(path, SIZE_MAX))
+        return false;
+
+    // A mapped file is read-only, so its pixels are copied out to be encoded into and saved
+    if (file) {
+        auto copy = std::make_unique<std::uint8_t[]>(size());
+        for (std::size_t i = 0; i < size(); i++)
+            copy[i] = *byte(i);
+
+        file.reset();
+        image = std::move(copy);
+    }
+
+    return true;
+}
+
+bool Image::load(const std::string &path, std::size_t limit) {
+    if (map(path, false))
+        return true;
+
+    borrowed = false;
+    planes.clear();
+    plane_bits = 4;
+    plane_size = 0;
+
+    // QOI can only be decoded from the start, and is quick enough to decode whole
+    if (starts_as_qoi(path)) {
+        png.reset();
+        depth  = 8;
+        loaded = full_rows = 0;
+
+        std::unique_ptr<std::uint8_t[]> pixels;
+        if (!qoi_read(path, pixels, width, height, channels))
+            return false;
+
+        image  = std::move(pixels);
+        loaded = full_rows = height;
+        return true;
+    }
+
+    // Decode the common PNG formats in-tree, and leave everything else to stb
+    png = std::make_unique<PngReader>();
+    if (png->open(path)) {
+        width    = png->w();
+        height   = png->h();
+        channels = png->c();
+        depth    = png->d();
+        loaded   = 0;
+
+        full_rows = static_cast<unsigned int>((std::min(limit, size()) + stride() - 1) / stride());
+
+        // Left uninitialised, so that rows that are never decoded are never touched either
+        image.reset(new std::uint8_t[stride() * full_rows]);
+
+        return require(full_rows * stride());
+    }
+
+    png.reset();
+
+    int x, y, n;
+
+    // x, y and n are only set once stb has loaded the image, so it has to happen before they are passed on
+    bool wide = stbi_is_16_bit(path.c_str());
+    void *buffer = wide ? static_cast<void*>(stbi_load_16(path.c_str(), &x, &y, &n, 0)) : stbi_load(path.c_str(), &x, &y, &n, 0);
+
+    return take_stb(buffer, x, y, n, wide);
+}
+
+bool Image::load(const std::uint8_t *data, std::size_t size) {
+    file.reset();
+    png.reset();
+    borrowed = false;
+    planes.clear();
+    plane_bits = 4;
+    plane_size = 0;
+
+    // Uncompressed images are copied out in the order that stb would load them
+    if (parse_raw_layout(data, size, false, layout)) {
+        width    = layout.width;
+        height   = layout.height;
+        channels = layout.channels;
+        depth    = layout.depth;
+        loaded   = full_rows = height;
+
+        std::size_t pixel_size = channels * (depth / 8);
+        image = std::make_unique<std::uint8_t[]>(this->size());
+
+        for (unsigned int y = 0; y < height; y++) {
+            auto *in  = data + layout.offset + (layout.bottom_up ? height - 1 - y : y) * layout.row_stride;
+            auto *out = &image[y * stride()];
+
+            for (std::size_t i = 0; i < stride(); i++)
+                out[i] = in[i / pixel_size * pixel_size + layout.order[i % pixel_size]];
+        }
 
-    auto *buffer = stbi_load(path.c_str(), &x, &y, &n, n);
+        return true;
+    }
+
+    if (is_qoi(data, size)) {
+        depth = 8;
+
+        std::unique_ptr<std::uint8_t[]> pixels;
+        if (!qoi_decode(data, size, pixels, width, height, channels))
+            return false;
+
+        image  = std::move(pixels);
+        loaded = full_rows = height;
+        return true;
+    }
+
+    if (size > INT_MAX)
+        return false;
+
+    int x, y, n;
+
+    bool wide = stbi_is_16_bit_from_memory(data, int(size));
+    void *buffer = wide ? static_cast<void*>(stbi_load_16_from_memory(data, int(size), &x, &y, &n, 0)) : stbi_load_from_memory(data, int(size), &x, &y, &n, 0);
+
+    return take_stb(buffer, x, y, n, wide);
+}
+
+bool Image::share(const Image &other) {
+    if (other.file || !other.image || other.loaded != other.height || other.full_rows != other.height)
+        return false;
+
+    file.reset();
+    png.reset();
+    planes.clear();
+    plane_bits = 4;
+    plane_size = 0;
+
+    image     = other.image;
+    borrowed  = true;
+    width     = other.width;
+    height    = other.height;
+    channels  = other.channels;
+    depth     = other.depth;
+    loaded    = full_rows = height;
+
+    return true;
+}
+
+// Keeps whatever channels and depth stb loaded, 16-bit samples are stored big-endian like a PNG does
+bool Image::take_stb(void *buffer, int x, int y, int n, bool wide) {
     if (!buffer)
         return false;
 
-    image = std::make_unique<std::uint8_t[]>(x * y * 4);
-    std::copy_n(buffer, x * y * 4, image.get());
+    std::size_t count = std::size_t(x) * y * n;
+
+    if (wide) {
+        auto *samples = static_cast<std::uint16_t*>(buffer);
+        image = std::make_unique<std::uint8_t[]>(count * 2);
+
+        for (std::size_t i = 0; i < count; i++) {
+            image[i * 2 + 0] = samples[i] >> 8;
+            image[i * 2 + 1] = samples[i] & 0xff;
+        }
+
+        depth = 16;
+    }
+    else {
+        image = std::make_unique<std::uint8_t[]>(count);
+        std::copy_n(static_cast<std::uint8_t*>(buffer), count, image.get());
+        depth = 8;
+    }
+
     stbi_image_free(buffer);
 
-    width  = x;
-    height = y;
+    width    = x;
+    height   = y;
+    channels = n;
+    loaded   = full_rows = y;
 
     return true;
 }
 
-bool Image::save(const std::string &path) {
-    int result = stbi_write_png(path.c_str(), width, height, 4, image.get(), width * 4);
+bool Image::info(const std::string &path, unsigned int &width, unsigned int &height, unsigned int &channels, unsigned int &depth) {
+    // Mapping only reads the header
+    Image image;
+    if (image.map(path, false)) {
+        width    = image.w();
+        height   = image.h();
+        channels = image.c();
+        depth    = image.d();
+        return true;
+    }
+
+    if (starts_as_qoi(path)) {
+        depth = 8;
+        return qoi_info(path, width, height, channels);
+    }
+
+    int x, y, n;
+    if (!stbi_info(path.c_str(), &x, &y, &n))
+        return false;
 
-    return result != 0;
+    width    = x;
+    height   = y;
+    channels = n;
+    depth    = stbi_is_16_bit(path.c_str()) ? 16 : 8;
+
+    return true;
 }
 
-void Image::encode(const std::uint8_t *data, std::size_t size, EncodingLevel level, std::size_t offset) {
+bool Image::map(const std::string &path, bool writable) {
+    file.reset();
+
+    auto mapped = std::make_unique<MappedFile>();
+    if (!mapped->open(path, writable))
+        return false;
+
+    if (!parse_raw_layout(mapped->data(), mapped->size(), extension_of(path) == ".tga", layout))
+        return false;
+
+    file = std::move(mapped);
+    image.reset();
+    borrowed = false;
+    png.reset();
+    planes.clear();
+
+    width    = layout.width;
+    height   = layout.height;
+    channels = layout.channels;
+    depth    = layout.depth;
+    loaded   = full_rows = height;
+
+    return true;
+}
+
+bool Image::sync() {
+    return file && file->flush();
+}
+
+void Image::unmap() {
+    file.reset();
+    loaded = full_rows = 0;
+}
+
+bool Image::require(std::size_t limit) {
+    auto stride = this->stride();
+    if (limit > stride * height)
+        return false;
+
+    auto rows = static_cast<unsigned int>((limit + stride - 1) / stride);
+    if (rows <= loaded)
+        return true;
+    if (!png)
+        return false;
+
+    bool ok = true;
+
+    // Whole rows go straight into place
+    if (loaded < full_rows) {
+        auto count = std::min(rows, full_rows) - loaded;
+        ok = png->read_rows(&image[loaded * stride], count);
+        loaded += ok ? count : 0;
+    }
+
+    row.resize(stride);
+
+    for (; loaded < rows && ok; loaded++) {
+        ok = png->read_rows(row.data(), 1);
+        if (ok)
+            pack_row(row.data());
+    }
+
+    // The reader is done with once every row is in, or if it failed part way
+    if (!ok || loaded == height)
+        png.reset();
+
+    return ok;
+}
+
+void Image::keep_level(EncodingLevel level) {
+    auto bits = level_bits(level);
+    if (bits >= plane_bits)
+        return;
+
+    // Repack what has been decoded so far
+    auto count = plane_size / plane_bits;
+    auto mask  = (1u << bits) - 1;
+
+    std::vector<std::uint8_t> packed(count * bits / 8 + 8);
+
+    if (depth == 8) {
+        for (std::size_t i = 0; i < count; i++)
+            put_bits(packed.data(), i * bits, plane_bits_at(i) & mask, bits);
+    }
+    else {
+        // Both halves of a 16-bit sample come out of its low byte
+        for (std::size_t i = 0; i < count; i += 2) {
+            auto low = plane_bits_at(i) | (plane_bits_at(i + 1) << plane_bits);
+            put_bits(packed.data(), i * bits, low & ((1u << bits * 2) - 1), bits * 2);
+        }
+    }
+
+    planes.swap(packed);
+    plane_bits = bits;
+    plane_size = count * bits;
+}
+
+void Image::pack_row(const std::uint8_t *row) {
+    auto stride = this->stride();
+
+    // Room for the whole row, plus slack for put_bits() and decode()
+    planes.resize((plane_size + stride * plane_bits) / 8 + 8);
+
+    // A 16-bit sample's two bytes share the bits of its low byte
+    if (depth == 16) {
+        auto mask = (1u << plane_bits * 2) - 1;
+        for (std::size_t i = 1; i < stride; i += 2, plane_size += plane_bits * 2)
+            put_bits(planes.data(), plane_size, row[i] & mask, plane_bits * 2);
+
+        return;
+    }
+
+    std::size_t i = 0;
+    for (; i + 8 <= stride; i += 8, plane_size += plane_bits * 8) {
+        switch (plane_bits) {
+            case 1: put_bits(planes.data(), plane_size, pack_low_bits<1>(row + i), 8);  break;
+            case 2: put_bits(planes.data(), plane_size, pack_low_bits<2>(row + i), 16); break;
+            case 4: put_bits(planes.data(), plane_size, pack_low_bits<4>(row + i), 32); break;
+        }
+    }
+
+    for (; i < stride; i++, plane_size += plane_bits)
+        put_bits(planes.data(), plane_size, row[i] & ((1u << plane_bits) - 1), plane_bits);
+}
+
+// The plane_bits bits packed for a channel byte, counting from the first packed one
+unsigned int Image::plane_bits_at(std::size_t index) const {
+    auto pos = index * plane_bits;
+    return ((planes[pos / 8] | (planes[pos / 8 + 1] << 8)) >> (pos % 8)) & ((1u << plane_bits) - 1);
+}
+
+// Where a channel byte is, mapped files keep their own row order, padding and channel order
+const std::uint8_t *Image::byte(std::size_t index) const {
+    if (!file)
+        return &image[index];
+
+    std::size_t pixel_size = channels * (depth / 8);
+    auto pixel = index / pixel_size;
+    auto y     = pixel / width;
+    auto row   = layout.bottom_up ? height - 1 - y : y;
+
+    return file->data() + layout.offset + row * layout.row_stride + (pixel % width) * pixel_size + layout.order[index % pixel_size];
+}
+
+unsigned int Image::low_bits(std::size_t index, unsigned int bits) const {
+    auto first = std::size_t(full_rows) * stride();
+    unsigned int low;
+
+    if (index >= first && depth == 16) {
+        // Put the low byte back together, its bits are only split the same way when plane_bits matches
+        auto sample = (index - first) & ~std::size_t(1);
+        low = plane_bits_at(sample) | (plane_bits_at(sample + 1) << plane_bits);
+    }
+    else if (index >= first) {
+        return plane_bits_at(index - first) & ((1u << bits) - 1);
+    }
+    else {
+        low = *byte(depth == 16 ? index | 1 : index);
+    }
+
+    if (depth == 16)
+        low >>= (index & 1) * bits;
+
+    return low & ((1u << bits) - 1);
+}
+
+void Image::set_low_bits(std::size_t index, unsigned int bits, unsigned int value) {
+    auto shift = depth == 16 ? (index & 1) * bits : 0;
+    auto out   = const_cast<std::uint8_t*>(byte(depth == 16 ? index | 1 : index));
+
+    *out = (*out & ~(((1u << bits) - 1) << shift)) | (value << shift);
+}
+
+bool Image::save(const std::string &path, PngProfile profile) {
+    // Mapped images are saved by sync()
+    if (file)
+        return false;
+
+    if (extension_of(path) == ".qoi")
+        return can_save(path) && qoi_write(path, image.get(), width, height, channels);
+
+    auto &settings = png_profiles[static_cast<int>(profile)];
+
+    PngWriter writer(settings.level, settings.strategy, settings.filter);
+    return writer.write(path, image.get(), width, height, channels, depth);
+}
+
+bool Image::save(std::ostream &out, PngProfile profile) {
+    if (file)
+        return false;
+
+    auto &settings = png_profiles[static_cast<int>(profile)];
+
+    PngWriter writer(settings.level, settings.strategy, settings.filter);
+    return writer.write(out, image.get(), width, height, channels, depth);
+}
+
+bool Image::can_save(const std::string &path) const {
+    if (extension_of(path) == ".qoi")
+        return depth == 8 && channels >= 3;
+
+    return true;
+}
+
+// How many channels a mask picks
+static unsigned int count_channels(unsigned int mask) {
+    unsigned int count = 0;
+    for (; mask; mask &= mask - 1)
+        count++;
+
+    return count;
+}
+
+unsigned int Image::picked(unsigned int mask) const {
+    auto all = (1u << channels) - 1;
+    return mask ? mask & all : all;
+}
+
+std::size_t Image::size(unsigned int mask) const {
+    return std::size_t(width) * height * count_channels(picked(mask)) * (depth / 8);
+}
+
+std::size_t Image::extent(std::size_t end, unsigned int mask) const {
+    std::size_t count = count_channels(picked(mask)) * (depth / 8);
+    return count ? (end + count - 1) / count * channels * (depth / 8) : 0;
+}
+
+// Walks through the channel bytes picked by a mask, starting at the offset-th one
+class ChannelCursor
+{
+public:
+    ChannelCursor(unsigned int channels, unsigned int bytes, unsigned int mask, std::size_t offset) : pixel_size(channels * bytes), count(0) {
+        for (unsigned int c = 0; c < channels; c++)
+            if (mask & (1u << c))
+                for (unsigned int b = 0; b < bytes; b++)
+                    picked[count++] = c * bytes + b;
+
+        pixel = offset / count;
+        next  = offset % count;
+    }
+
+    std::size_t operator()() {
+        auto index = pixel * pixel_size + picked[next];
+        if (++next == count) {
+            next = 0;
+            pixel++;
+        }
+
+        return index;
+    }
+
+private:
+    unsigned int pixel_size, count, next;
+    unsigned int picked[8];
+    std::size_t pixel;
+};
+
+void Image::encode(const std::uint8_t *data, std::size_t size, EncodingLevel level, std::size_t offset, unsigned int mask) {
+    // Shared pixels are copied the first time they are written to
+    if (borrowed) {
+        std::shared_ptr<std::uint8_t[]> copy(new std::uint8_t[this->size()]);
+        std::copy_n(image.get(), this->size(), copy.get());
+
+        image    = std::move(copy);
+        borrowed = false;
+    }
+
+    // Only some of the channels, 16-bit samples or a mapped file, the low bits of each byte of data are spread across the next picked channel bytes
+    if (picked(mask) != picked(0) || depth == 16 || file) {
+        auto bits = level_bits(level);
+        ChannelCursor next(channels, depth / 8, picked(mask), offset);
+
+        for (std::size_t i = 0; i < size; i++)
+            for (unsigned int j = 0; j < 8; j += bits)
+                set_low_bits(next(), bits, (data[i] >> j) & ((1u << bits) - 1));
+
+        return;
+    }
+
     auto image = this->image.get() + offset;
 
     if (level == EncodingLevel::Low) {
@@ -71,8 +604,41 @@ void Image::encode(const std::uint8_t *data, std::size_t size, EncodingLevel lev
     }
 }
 
-std::unique_ptr<std::uint8_t[]> Image::decode(std::size_t size, EncodingLevel level, std::size_t offset) {
+std::unique_ptr<std::uint8_t[]> Image::decode(std::size_t size, EncodingLevel level, std::size_t offset, unsigned int mask) {
     auto data  = std::make_unique<std::uint8_t[]>(size);
+    auto first = std::size_t(full_rows) * stride();
+
+    // Packed rows at the same level already hold the data bytes, just not always byte aligned
+    if (picked(mask) == picked(0) && offset >= first && level_bits(level) == plane_bits) {
+        auto pos   = (offset - first) * plane_bits;
+        auto in    = planes.data() + pos / 8;
+        auto shift = pos % 8;
+
+        if (!shift)
+            std::copy_n(in, size, data.get());
+        else
+            for (std::size_t i = 0; i < size; i++)
+                data[i] = (in[i] >> shift) | (in[i + 1] << (8 - shift));
+
+        return data;
+    }
+
+    // Anything else that isn't 8-bit samples in whole decoded rows goes a channel byte at a time
+    if (picked(mask) != picked(0) || depth == 16 || file || offset + encoded_size(size, level) > first) {
+        auto bits = level_bits(level);
+        ChannelCursor next(channels, depth / 8, picked(mask), offset);
+
+        for (std::size_t i = 0; i < size; i++) {
+            unsigned int value = 0;
+            for (unsigned int j = 0; j < 8; j += bits)
+                value |= low_bits(next(), bits) << j;
+
+            data[i] = value;
+        }
+
+        return data;
+    }
+
     auto image = this->image.get() + offset;
 
     if (level == EncodingLevel::Low) {
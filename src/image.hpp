@@ -2,7 +2,14 @@
 
 #include <cstdint>
 #include <string>
+#include <ostream>
 #include <memory>
+#include <vector>
+
+#include "raw_layout.hpp"
+
+class PngReader;
+class MappedFile;
 
 class Image
 {
@@ -13,20 +20,105 @@ public:
         High = 2,
     };
 
+    // Trades PNG write time against output size
+    enum class PngProfile {
+        Fast     = 0,
+        Balanced = 1,
+        Small    = 2,
+    };
+
     Image();
+    ~Image();
 
+    // Decodes the whole image, uncompressed files that map() takes are read through a mapping and copied out
     bool load(const std::string &path);
-    bool save(const std::string &path);
 
-    void encode(const std::uint8_t *data, std::size_t size, EncodingLevel level, std::size_t offset = 0);
-    std::unique_ptr<std::uint8_t[]> decode(std::size_t size, EncodingLevel level, std::size_t offset = 0);
+    // Only decodes the rows covering the first limit bytes of pixel data when the format allows it. Any rows after
+    // them are decoded by require(), and only keep the low bits of their channel bytes, so they can be decoded but not encoded.
+    // Files that map() takes are mapped read-only instead.
+    bool load(const std::string &path, std::size_t limit);
+
+    // Decodes a whole image held in memory, such as one read from stdin
+    bool load(const std::uint8_t *data, std::size_t size);
+
+    // Makes this a copy of a whole decoded image that shares its pixels, the pixels are only copied once this one is encoded
+    // into. The image shared from has to be left as it is. Fails for mapped and partly decoded images.
+    bool share(const Image &other);
+
+    // Reads just the size of an image, without decoding it
+    static bool info(const std::string &path, unsigned int &width, unsigned int &height, unsigned int &channels, unsigned int &depth);
+
+    // Maps an uncompressed BMP, PGM/PPM, PAM or TGA file instead of decoding it, decode() then only reads the bytes it needs
+    // and encode() writes straight into the file if it is writable. Fails for anything else.
+    bool map(const std::string &path, bool writable);
+
+    // Makes sure that everything encoded into a mapped image has reached its file
+    bool sync();
+
+    // Drops the mapping of a mapped image, so that its file can be renamed or removed. Only its size is left.
+    void unmap();
+
+    // Decodes more rows until the first limit bytes of pixel data are available, fails if they are past the end of the image
+    bool require(std::size_t limit);
+
+    // Rows decoded by require() keep the low 4 bits of each channel byte, this drops the ones a level doesn't use.
+    // Nothing can be decoded at a higher level afterwards.
+    void keep_level(EncodingLevel level);
+
+    // Writes a QOI image when the path ends in .qoi, and a PNG otherwise
+    bool save(const std::string &path, PngProfile profile = PngProfile::Balanced);
+
+    // Writes a PNG to a stream, such as stdout
+    bool save(std::ostream &out, PngProfile profile = PngProfile::Balanced);
+
+    // Whether the format that save() picks for a path can hold this image, QOI only takes 8-bit RGB and RGBA
+    bool can_save(const std::string &path) const;
+
+    // A channel mask picks which channels of each pixel hold data (bit 0 is the first channel), 0 picks all of them.
+    // The offset counts only the channel bytes that the mask picks.
+    void encode(const std::uint8_t *data, std::size_t size, EncodingLevel level, std::size_t offset = 0, unsigned int mask = 0);
+    std::unique_ptr<std::uint8_t[]> decode(std::size_t size, EncodingLevel level, std::size_t offset = 0, unsigned int mask = 0);
 
     static std::size_t encoded_size(std::size_t size, EncodingLevel level);
 
     unsigned int w() const { return width; }
     unsigned int h() const { return height; }
+    unsigned int c() const { return channels; }
+    unsigned int d() const { return depth; }
+
+    // Channel bytes in the whole image, what the data is encoded into. 16-bit samples count as two bytes, but their
+    // bits all go into the low byte (big-endian, so the second one), which makes it twice as many bits as an 8-bit sample.
+    std::size_t size() const { return std::size_t(width) * height * channels * (depth / 8); }
+
+    // Channel bytes picked by a channel mask
+    std::size_t size(unsigned int mask) const;
+
+    // How many channel bytes have to be decoded to cover the first end bytes picked by a channel mask
+    std::size_t extent(std::size_t end, unsigned int mask) const;
 
 private:
-    std::unique_ptr<std::uint8_t[]> image;
-    unsigned int width, height;
+    std::shared_ptr<std::uint8_t[]> image;
+    bool borrowed; // The pixels came from share(), and have to be copied before they are written to
+    unsigned int width, height, channels, depth;
+
+    std::size_t stride() const { return std::size_t(width) * channels * (depth / 8); }
+    unsigned int picked(unsigned int mask) const;
+    bool take_stb(void *buffer, int x, int y, int n, bool wide);
+    void pack_row(const std::uint8_t *row);
+    unsigned int plane_bits_at(std::size_t index) const;
+    const std::uint8_t *byte(std::size_t index) const;
+    unsigned int low_bits(std::size_t index, unsigned int bits) const;
+    void set_low_bits(std::size_t index, unsigned int bits, unsigned int value);
+
+    std::unique_ptr<MappedFile> file; // Mapping of an uncompressed image, in place of image
+    RawLayout layout;
+
+    std::unique_ptr<PngReader> png; // Reader of the rows not decoded yet
+    unsigned int loaded;            // Rows decoded so far
+    unsigned int full_rows;         // Rows kept whole in image
+
+    std::vector<std::uint8_t> planes; // Low plane_bits bits of every channel byte past the full rows, packed together
+    std::vector<std::uint8_t> row;    // Row being packed
+    unsigned int plane_bits;
+    std::size_t plane_size;           // Bits used in planes
 };
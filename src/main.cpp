@@ -3,269 +3,1045 @@
 #include <filesystem>
 #include <algorithm>
 #include <array>
+#include <future>
+#include <chrono>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <condition_variable>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include "argparse/argparse.hpp"
-#include "aes.hpp"
-#include "sha256.hpp"
-#include "crc32.hpp"
 #include "random.hpp"
 #include "image.hpp"
+#include "steganography.hpp"
+#include "cover_cache.hpp"
+#include "thread_pool.hpp"
+#include "pipeline.hpp"
+#include "server.hpp"
+#include "reed_solomon.hpp"
 #include "utils.hpp"
 
-#define VERSION 1
-#define KEY_ROUNDS 20000
 #define LEVEL Image::EncodingLevel::Low
 
 namespace fs = std::filesystem;
 
-// 64 bytes
-struct Header {
-    // std::uint8_t salt[16];
-    // std::uint8_t iv  [16];
-    std::uint8_t  sig[4];   // File Signature (HIDE)
-    std::uint16_t version;  // Format Version
-    std::uint8_t  level;    // Encoding level
-    std::uint8_t  flags;    // Flags
-    std::uint32_t offset;   // Offset to data
-    std::uint32_t size;     // Size of data
-    std::uint32_t hash;     // CRC32 hash of data
-    std::uint8_t  name[32]; // File name, unused space filled with zeros
-    std::uint8_t  reserved[12]; // Must be filled with zeros
-};
-static_assert(sizeof(Header) == 64);
+// Finds the PNG profile with that name
+bool parse_profile(const std::string &str, Image::PngProfile &profile) {
+    if (str == "fast")
+        profile = Image::PngProfile::Fast;
+    else if (str == "balanced")
+        profile = Image::PngProfile::Balanced;
+    else if (str == "small")
+        profile = Image::PngProfile::Small;
+    else {
+        std::cerr << "ERROR: Unknown PNG profile '" << str << "'" << std::endl;
+        return false;
+    }
 
-const char *level_to_str[3] = {
-    "Low (Default)",
-    "Medium",
-    "High"
-};
+    return true;
+}
 
-int encode(Image &image, const std::array<std::uint8_t, 32> &password, const std::string &input, const std::string &output, Image::EncodingLevel level) {
-    // Open the data file
-    std::ifstream file(input, std::ios::in | std::ios::binary | std::ios::ate);
-    if (!file.is_open()) {
-        std::cerr << "ERROR: Unable to open file '" << input << "'" << std::endl;
-        return -1;
+// "-" stands for stdin or stdout in place of a file
+static bool is_stdio(const std::string &path) {
+    return path == "-";
+}
+
+// Stops Windows from translating line endings in data going through stdin and stdout
+static void binary_stdio() {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+// Reads stdin in chunks until it ends, and fails once there are more than limit bytes, so that a stream too big for a
+// cover is never held whole
+bool read_stdin(std::vector<std::uint8_t> &data, std::size_t limit) {
+    binary_stdio();
+
+    std::vector<std::uint8_t> chunk(64 * 1024);
+    std::size_t count;
+
+    while ((count = std::fread(chunk.data(), 1, chunk.size(), stdin))) {
+        if (count > limit - std::min(limit, data.size()))
+            return false;
+
+        data.insert(data.end(), chunk.begin(), chunk.begin() + count);
+    }
+
+    return !std::ferror(stdin);
+}
+
+// Reads a whole file, or stdin for "-", into data. too_big is set when it holds more than limit bytes.
+bool read_input(const std::string &path, std::vector<std::uint8_t> &data, std::size_t limit, bool &too_big) {
+    too_big = false;
+    data.clear();
+
+    if (is_stdio(path)) {
+        if (read_stdin(data, limit))
+            return true;
+
+        too_big = !std::ferror(stdin);
+        return false;
     }
 
-    std::cout << "* Image size: " << image.w() << "x" << image.h() << " pixels" << std::endl;
-    std::cout << "* Encoding level: " << level_to_str[static_cast<int>(level)] << std::endl;
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return false;
 
-    // Find the data and padded-data size
     std::size_t size = file.tellg();
-    std::size_t padded_size = size + 1; // At least one byte of padding
-    
-    if (padded_size % 16)
-        padded_size = (size / 16 + 1) * 16;
+    if (size > limit) {
+        too_big = true;
+        return false;
+    }
+
+    // Leave room for the padding
+    data.reserve(size + 16);
+    data.resize(size);
+
+    file.seekg(0, std::ios::beg);
+    return bool(file.read(reinterpret_cast<char*>(data.data()), size));
+}
+
+// An encode of files, the cover, embed-file and output image are paths or "-" for stdin and stdout. load_cover(),
+// read_embed(), open_output() and save_cover() do the steps of an EncodeJob that touch them.
+struct FileEncodeJob : EncodeJob {
+    FileEncodeJob(const std::string &cover, const std::string &input, const std::string &output, Image::EncodingLevel level, Image::PngProfile profile, const std::string &channels, bool fec, std::ostream &log, std::ostream &err)
+        : EncodeJob(level, channels, fec, log, err), cover(cover), input(input), output(output), profile(profile), in_place(false), cache(nullptr) {
+        if (!is_stdio(input))
+            name = fs::path(input).filename().string();
+    }
+
+    // A copy of the cover left by an encode that failed is removed, so it can't pass for a finished image
+    ~FileEncodeJob() {
+        if (!temp.empty()) {
+            std::error_code removed;
+            image.unmap();
+            fs::remove(temp, removed);
+        }
+    }
+
+    std::string cover, input, output;
+    Image::PngProfile profile;
+    bool in_place;
+    std::string temp;  // Copy of an in-place cover being embedded into, renamed to the output once saved
+    CoverCache *cache; // Decoded covers to reuse, none if null
+};
+
+// Loads the cover, and works out how much it can hold
+int load_cover(FileEncodeJob &job) {
+    auto &err = job.err;
+    auto &image = job.image;
 
-    // Find the maximum possible size for the file
-    unsigned int max_size = image.w()*image.h()*4/Image::encoded_size(1, level) - Image::encoded_size(sizeof(Header)+32, Image::EncodingLevel::Low); // FIXME
+    // Uncompressed covers written back out in the same format are copied and edited in place, rather than decoded and re-encoded.
+    // Until open_output() makes the copy, the cover is only mapped to read it.
+    job.in_place = !is_stdio(job.cover) && !is_stdio(job.output) && fs::path(job.cover).extension() == fs::path(job.output).extension() && image.map(job.cover, false);
 
-    std::cout << "* Max embed size: " << data_size(max_size) << std::endl;
-    std::cout << "* Embed size: " << data_size(size) << std::endl;
-    std::cout << "* Encrypted embed size: " << data_size(padded_size) << std::endl;
+    if (is_stdio(job.cover)) {
+        std::vector<std::uint8_t> cover;
+        bool too_big;
 
-    // Make sure that it isn't too big
-    if (padded_size > max_size) {
-        std::cerr << "ERROR: Data-File too big, maximum possible size: " << (max_size / 1024) << " KiB" << std::endl;
+        if (!read_input(job.cover, cover, SIZE_MAX, too_big) || !image.load(cover.data(), cover.size())) {
+            err << "ERROR: Failed to load image from stdin" << std::endl;
+            return -1;
+        }
+    }
+    else if (!job.in_place && (job.cache ? !job.cache->load(job.cover, image) : !image.load(job.cover))) {
+        err << "ERROR: Failed to load image " << job.cover << std::endl;
         return -1;
     }
 
-    // Read the data
-    auto padded_data = std::make_unique<uint8_t[]>(padded_size);
-    file.seekg(0, std::ios::beg);
-    file.read(reinterpret_cast<char*>(padded_data.get()), size);
-    file.close();
+    if (!image.can_save(job.output)) {
+        err << "ERROR: Unable to write a " << image.c() << " channel, " << image.d() << "-bit image to '" << job.output << "', QOI only takes 8-bit RGB and RGBA" << std::endl;
+        return -1;
+    }
+
+    return fit_cover(job);
+}
+
+// Reads the embed-file into the job
+int read_embed(FileEncodeJob &job) {
+    auto limit = max_unpadded(job.max_size, job.fec);
+    bool too_big;
+
+    if (read_input(job.input, job.data, limit, too_big))
+        return 0;
+
+    if (too_big)
+        job.err << "ERROR: Data-File too big, maximum possible size: " << (limit / 1024) << " KiB" << std::endl;
+    else
+        job.err << "ERROR: Unable to read file '" << job.input << "'" << std::endl;
+
+    return -1;
+}
 
-    // Pad the data (#PKCS7)
-    std::uint8_t left = padded_size - size;
-    std::fill_n(padded_data.get() + size, left, left);
+// Copies an in-place cover to a file next to the output and maps it to embed into, nothing is written until the embed is known
+// to fit. The copy keeps the output's extension, which tells map() how to read it.
+int open_output(FileEncodeJob &job) {
+    if (!job.in_place)
+        return 0;
 
-    // Pick a random offset inside the image to store the data
-    std::uint32_t offset;
     Random random;
-    if (!random.get(&offset, sizeof(offset)))
-    {
-        std::cerr << "Unable to generate random number" << std::endl;
+    std::uint32_t suffix;
+    if (!random.get(&suffix, sizeof(suffix))) {
+        job.err << "ERROR: Unable to generate random number" << std::endl;
         return -1;
     }
 
-    offset = (offset + Image::encoded_size(sizeof(Header) + 32, Image::EncodingLevel::Low)) % (Image::encoded_size(max_size - padded_size, level));
+    std::ostringstream name;
+    auto output = fs::path(job.output);
+    name << "." << output.stem().string() << "-" << std::hex << std::setw(8) << std::setfill('0') << suffix << output.extension().string();
+    job.temp = (output.parent_path() / name.str()).string();
 
-    // Calculate a hash of the data
-    CRC32 crc;
-    crc.update(padded_data.get(), size);
+    std::error_code copied;
+    fs::copy_file(job.cover, job.temp, fs::copy_options::overwrite_existing, copied);
 
-    std::cout << "* Generated CRC32 checksum" << std::endl;
+    if (copied || !job.image.map(job.temp, true)) {
+        job.err << "ERROR: Unable to write to '" << job.output << "'" << std::endl;
+        return -1;
+    }
 
-    // Copy the header information
-    Header header;
-    header.sig[0] = 'H'; header.sig[1] = 'I'; header.sig[2] = 'D'; header.sig[3] = 'E';
-    header.version = VERSION;
-    header.level  = static_cast<std::uint8_t>(level);
-    header.flags  = 0;
-    header.offset = offset;
-    header.size   = padded_size;
-    header.hash   = crc.get_hash();
-
-    // Copy the file name to the header
-    auto name = fs::path(input).filename().string();
-    if (name.size() > sizeof(header.name)) {
-        std::cerr << "ERROR: File name '" << name << "' is over 32 characters" << std::endl;
+    return 0;
+}
+
+// Saves the encoded image, a mapped one is flushed and renamed over the output
+int save_cover(FileEncodeJob &job) {
+    if (is_stdio(job.output)) {
+        binary_stdio();
+
+        if (!job.image.save(std::cout, job.profile) || !std::cout.flush()) {
+            job.err << "ERROR: Unable to write the image to stdout" << std::endl;
+            return -1;
+        }
+    }
+    else if (job.in_place) {
+        std::error_code renamed;
+        bool synced = job.image.sync();
+
+        // The mapping has to go before the file can be renamed on every platform
+        job.image.unmap();
+        if (synced)
+            fs::rename(job.temp, job.output, renamed);
+
+        if (!synced || renamed) {
+            job.err << "ERROR: Unable to save image '" << job.output << "'" << std::endl;
+            return -1;
+        }
+
+        job.temp.clear();
+    }
+    else if (!job.image.save(job.output, job.profile)) {
+        job.err << "ERROR: Unable to save image '" << job.output << "'" << std::endl;
         return -1;
     }
-    std::copy_n(name.data(), name.size(), header.name);
-    std::fill_n(&header.name[name.size()], sizeof(header.name) - name.size(), 0x00);
-    std::fill_n(header.reserved, sizeof(header.reserved), 0x00);
 
-    // Generate the Salt and IV
-    std::uint8_t salt[16], iv[16];
-    if (!random.get(salt, sizeof salt) || !random.get(iv, sizeof iv))
-    {
-        std::cerr << "ERROR: Unable to generate random number" << std::endl;
+    job.log << "* Successfully wrote to " << (is_stdio(job.output) ? "stdout" : job.output) << std::endl;
+
+    return 0;
+}
+
+int encode(const std::string &image_path, const std::array<std::uint8_t, 32> &password, const std::string &input, const std::string &output, Image::EncodingLevel level, Image::PngProfile profile, const std::string &channels, bool fec) {
+    if (is_stdio(image_path) && is_stdio(input)) {
+        std::cerr << "ERROR: Only one of the image and the embed-file can come from stdin" << std::endl;
         return -1;
     }
 
-    // Generate the Key
-    std::uint8_t key[32];
-    pbkdf2_hmac_sha256(password.data(), password.size(), salt, sizeof(salt), key, sizeof(key), KEY_ROUNDS);
+    // With the image going to stdout, the progress goes to stderr
+    FileEncodeJob job(image_path, input, output, level, profile, channels, fec, is_stdio(output) ? std::cerr : std::cout, std::cerr);
+
+    // Generate the Salt and IV, and start on the key straight away
+    if (generate_salt(job) < 0)
+        return -1;
 
-    std::cout << "* Generated encryption key with PBKDF2-HMAC-SHA-256 (" << KEY_ROUNDS << " rounds)" << std::endl;
+    auto pending_key = derive_key(password, job.salt);
 
-    // Encrypt the header
-    AES aes(key, iv);
-    auto encrypted_header = std::make_unique<uint8_t[]>(sizeof header);
-    aes.cbc_encrypt(&header, sizeof(header), encrypted_header.get());
+    if (load_cover(job) < 0 || read_embed(job) < 0 || pack_embed(job) < 0)
+        return -1;
 
-    // Encrypt the data
-    auto encrypted_data = std::make_unique<uint8_t[]>(padded_size);
-    aes.cbc_encrypt(padded_data.get(), padded_size, encrypted_data.get());
+    // Wait for the Key
+    job.key = pending_key.get();
 
-    std::cout << "* Encrypted embed with AES-256-CBC" << std::endl;
+    if (open_output(job) < 0 || embed_payload(job) < 0 || save_cover(job) < 0)
+        return -1;
 
-    // Encode the data
-    image.encode(salt, 16, level);
-    image.encode(iv, 16, level, Image::encoded_size(16, Image::EncodingLevel::Low));
-    image.encode(encrypted_header.get(), sizeof(Header), level, Image::encoded_size(32, Image::EncodingLevel::Low));
-    image.encode(encrypted_data.get(), padded_size, level, offset);
+    return 0;
+}
 
-    std::cout << "* Embedded " << name << " into image" << std::endl;
+// Splits the embed-file into contiguous shards, one per cover, each sized in proportion to what its cover can hold. With parity,
+// the last covers get Reed-Solomon parity shards instead, and every shard is the same size. Every shard gets its own salt, key
+// and header, and the covers are loaded and the shards encrypted, embedded and saved in parallel.
+int encode_shards(const std::vector<std::string> &covers, const std::array<std::uint8_t, 32> &password, const std::string &input, const std::vector<std::string> &outputs, unsigned int parity, Image::EncodingLevel level, Image::PngProfile profile, const std::string &channels, bool fec) {
+    auto count = covers.size();
 
-    // Save the encoded image
-    if (!image.save(output)) {
-        std::cout << "Unable to save image!" << std::endl;
-        return false;
+    if (count != outputs.size()) {
+        std::cerr << "ERROR: Got " << count << " input images but " << outputs.size() << " output images" << std::endl;
+        return -1;
     }
 
-    std::cout << "* Successfully wrote to " << output << std::endl;    
+    if (count > 255) {
+        std::cerr << "ERROR: An embed can be split across at most 255 images" << std::endl;
+        return -1;
+    }
 
-    return true;
-}
+    if (parity >= count) {
+        std::cerr << "ERROR: " << parity << " parity images leave none of the " << count << " images for the embed" << std::endl;
+        return -1;
+    }
 
-int decode(Image &image, const std::array<std::uint8_t, 32> &password, std::string output) {
-    std::cout << "* Image size: " << image.w() << "x" << image.h() << " pixels" << std::endl;
+    if (std::any_of(covers.begin(), covers.end(), is_stdio) || std::any_of(outputs.begin(), outputs.end(), is_stdio)) {
+        std::cerr << "ERROR: Sharded images can't come from stdin or go to stdout" << std::endl;
+        return -1;
+    }
+
+    // Two shards written to the same image would leave just one of them
+    std::set<fs::path> seen;
+    for (auto &output : outputs) {
+        if (!seen.insert(fs::absolute(output).lexically_normal()).second) {
+            std::cerr << "ERROR: More than one shard writes to '" << output << "'" << std::endl;
+            return -1;
+        }
+    }
 
-    // Extract the Salt and IV
-    auto salt = image.decode(16, Image::EncodingLevel::Low);
-    auto iv   = image.decode(16, Image::EncodingLevel::Low, Image::encoded_size(16, Image::EncodingLevel::Low));
+    std::vector<std::ostringstream> logs(count), errs(count);
+    std::vector<std::unique_ptr<FileEncodeJob>> jobs;
+    for (std::size_t i = 0; i < count; i++)
+        jobs.push_back(std::make_unique<FileEncodeJob>(covers[i], input, outputs[i], level, profile, channels, fec, logs[i], errs[i]));
+
+    // Runs a step on every shard at once, then prints what each of them logged, in order
+    auto run = [&](const std::function<int(FileEncodeJob&)> &step) {
+        std::vector<int> results(count);
+        ThreadPool::shared().parallel_for(count, [&](std::size_t i) {
+            results[i] = step(*jobs[i]);
+        });
+
+        for (std::size_t i = 0; i < count; i++) {
+            std::cout << "* Shard " << (i + 1) << " of " << count << ", " << jobs[i]->cover << " -> " << jobs[i]->output << std::endl;
+            std::cout << logs[i].str();
+            std::cerr << errs[i].str();
+            logs[i].str("");
+            errs[i].str("");
+        }
+
+        return std::find(results.begin(), results.end(), -1) == results.end() ? 0 : -1;
+    };
 
-    // Generate the key
-    std::uint8_t key[32];
-    pbkdf2_hmac_sha256(password.data(), password.size(), salt.get(), 16, key, sizeof(key), KEY_ROUNDS);
+    if (run([](FileEncodeJob &job) { return generate_salt(job) < 0 ? -1 : load_cover(job); }) < 0)
+        return -1;
 
-    std::cout << "* Generated decryption key with PBKDF2-HMAC-SHA-256 (" << KEY_ROUNDS << " rounds)" << std::endl;
+    // Work out how much the covers can hold between them. Parity needs every shard to be the same size, so then the smallest
+    // cover sets the size of them all.
+    std::vector<std::size_t> usable(count);
+    std::vector<std::vector<std::uint8_t>> shards(count);
+    std::size_t capacity = 0;
 
-    // Extract the header
-    auto encrypted_header = image.decode(sizeof(Header), Image::EncodingLevel::Low, Image::encoded_size(32, Image::EncodingLevel::Low));
+    for (std::size_t i = 0; i < count; i++) {
+        usable[i] = max_unpadded(jobs[i]->max_size, jobs[i]->fec);
+        capacity += usable[i];
+    }
 
-    // Decrypt the header
-    AES aes(key, iv.get());
-    Header header;
-    aes.cbc_decrypt(encrypted_header.get(), sizeof(Header), &header);
-    auto level = static_cast<Image::EncodingLevel>(header.level);
+    auto smallest = *std::min_element(usable.begin(), usable.end());
+    auto limit    = std::min<std::size_t>(parity ? smallest * (count - parity) : capacity, UINT32_MAX);
 
-    // Make sure that the file-signature match, i.e. successful decryption
-    if (header.sig[0] != 'H' || header.sig[1] != 'I' || header.sig[2] != 'D' || header.sig[3] != 'E') {
-        std::cerr << "ERROR: Decryption failed, invalid key or corrupt file" << std::endl;
+    // Read the embed-file
+    std::vector<std::uint8_t> embed;
+    bool too_big;
+
+    if (!read_input(input, embed, limit, too_big)) {
+        if (too_big)
+            std::cerr << "ERROR: Data-File too big, maximum possible size across the images" << (parity ? " with " + std::to_string(parity) + " parity images" : "") << ": " << (limit / 1024) << " KiB" << std::endl;
+        else
+            std::cerr << "ERROR: Unable to read file '" << input << "'" << std::endl;
         return -1;
     }
 
-    // Make sure that the version is correct
-    if (header.version != VERSION) {
-        std::cerr << "ERROR: Unsupported file-version " << header.version << std::endl;
+    auto size = embed.size();
+
+    if (!parity) {
+        std::vector<std::size_t> lengths(count);
+        std::size_t assigned = 0;
+
+        for (std::size_t i = 0; i < count; i++) {
+            lengths[i] = capacity ? std::min(usable[i], std::size_t(double(size) * usable[i] / capacity)) : 0;
+            assigned  += lengths[i];
+        }
+
+        // What rounding left over goes to the covers with room to spare
+        for (std::size_t i = 0; i < count && assigned < size; i++) {
+            auto extra = std::min(size - assigned, usable[i] - lengths[i]);
+            lengths[i] += extra;
+            assigned   += extra;
+        }
+
+        std::size_t start = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            shards[i].assign(embed.begin() + start, embed.begin() + start + lengths[i]);
+            start += lengths[i];
+        }
+    }
+    else {
+        auto data_shards = count - parity;
+        auto length      = (size + data_shards - 1) / data_shards;
+
+        // The last data shard is filled out with zeros, the total size in the header says where the embed ends
+        std::vector<std::uint8_t*> pointers;
+        for (std::size_t i = 0; i < count; i++) {
+            auto start = std::min(size, i * length);
+            auto end   = i < data_shards ? std::min(size, start + length) : start;
+
+            shards[i].reserve(length + 16);
+            shards[i].assign(embed.begin() + start, embed.begin() + end);
+            shards[i].resize(length, 0);
+            pointers.push_back(shards[i].data());
+        }
+
+        ReedSolomon(data_shards, parity).encode(pointers.data(), length);
+
+        std::cout << "* Encoded " << parity << " parity shards with Reed-Solomon, any " << data_shards << " of the " << count << " images give back the embed" << std::endl;
+    }
+
+    embed = std::vector<std::uint8_t>();
+
+    // A random number ties the shards together, so that shards of different embeds aren't mixed up
+    std::uint32_t set;
+    if (!Random().get(&set, sizeof(set))) {
+        std::cerr << "ERROR: Unable to generate random number" << std::endl;
         return -1;
     }
 
-    // Make sure that the reserved data is all zeros
-    for (auto r : header.reserved) {
-        if (r) {
-            std::cerr << "ERROR: Decryption failed, invalid key or corrupt file" << std::endl;
+    for (std::size_t i = 0; i < count; i++) {
+        auto &job = *jobs[i];
+
+        job.data = std::move(shards[i]);
+
+        if (pack_embed(job) < 0) {
+            std::cerr << errs[i].str();
             return -1;
         }
+
+        job.header.set    = set;
+        job.header.shard  = i;
+        job.header.shards = count;
+        job.header.parity = parity;
+        job.header.total  = size;
     }
 
-    std::cout << "* Successfully decrypted header" << std::endl;
-    std::cout << "* File signatures match" << std::endl;
+    // Each shard derives its own key from its own salt
+    return run([&password](FileEncodeJob &job) {
+        job.key = generate_key(password, job.salt);
+        return open_output(job) < 0 || embed_payload(job) < 0 ? -1 : save_cover(job);
+    });
+}
 
-    // Copy the name, accounting for the fact that there might be no null-terminator
-    std::string name;
-    if (header.name[sizeof(header.name)-1])
-        name = std::string(reinterpret_cast<char*>(header.name), sizeof(header.name));
-    else
-        name = std::string(reinterpret_cast<char*>(header.name));
+// One line of a batch manifest
+struct BatchJob {
+    std::string cover, embed, output;
+    std::uintmax_t cover_size; // Size of the cover file, to order the jobs by
+};
 
-    std::cout << "* Detected embed " << name << std::endl;
-    std::cout << "* Encoding level: " << level_to_str[header.level] << std::endl;
+// Reads a manifest of "cover embed output" lines, paths with spaces in them can be double-quoted.
+// Blank lines and lines starting with # are skipped.
+bool read_manifest(const std::string &path, std::vector<BatchJob> &jobs) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "ERROR: Unable to open manifest '" << path << "'" << std::endl;
+        return false;
+    }
 
-    // Decode the data
-    auto encrypted_data = image.decode(header.size, level, header.offset);
+    std::string line;
+    for (unsigned int number = 1; std::getline(file, line); number++) {
+        std::istringstream fields(line);
+        fields >> std::ws;
 
-    std::cout << "* Encrypted embed size: " << data_size(header.size) << std::endl;
+        if (fields.eof() || fields.peek() == '#')
+            continue;
+
+        BatchJob job;
+        std::string extra;
+
+        if (!(fields >> std::quoted(job.cover) >> std::quoted(job.embed) >> std::quoted(job.output)) || fields >> extra) {
+            std::cerr << "ERROR: Line " << number << " of the manifest isn't 'cover embed output'" << std::endl;
+            return false;
+        }
+
+        if (is_stdio(job.cover) || is_stdio(job.embed) || is_stdio(job.output)) {
+            std::cerr << "ERROR: Line " << number << " of the manifest uses stdin or stdout, which a batch can't share between its jobs" << std::endl;
+            return false;
+        }
+
+        // A missing cover is left for its job to report
+        std::error_code error;
+        job.cover_size = fs::file_size(job.cover, error);
+        if (error)
+            job.cover_size = 0;
+
+        jobs.push_back(std::move(job));
+    }
+
+    return true;
+}
+
+// Worker threads of each stage of batch-encode
+struct StageWorkers {
+    unsigned int load, key, embed, save;
+};
+
+// Splits a number of threads between the stages, a sixth each to load and embed and the rest to the key and the save, which
+// take the longest. Loading is mostly waiting on the disk, while embedding is quick. Every stage needs a thread, so fewer
+// than 4 are taken as 4.
+StageWorkers default_stage_workers(unsigned int threads) {
+    threads = std::max(threads, 4u);
+
+    unsigned int load  = std::max(1u, threads / 6);
+    unsigned int embed = std::max(1u, threads / 6);
+    unsigned int rest  = threads - load - embed;
+
+    return {load, rest - rest / 2, embed, rest / 2};
+}
+
+// Turns "load,key,embed,save" worker counts into StageWorkers
+bool parse_stage_workers(const std::string &str, StageWorkers &workers) {
+    std::istringstream in(str);
+    char comma[3];
+
+    if (!(in >> workers.load >> comma[0] >> workers.key >> comma[1] >> workers.embed >> comma[2] >> workers.save) || !(in >> std::ws).eof() ||
+        comma[0] != ',' || comma[1] != ',' || comma[2] != ',' || !workers.load || !workers.key || !workers.embed || !workers.save) {
+        std::cerr << "ERROR: Stage workers '" << str << "' aren't four counts, like 2,4,2,4" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// A job of batch-encode, as it goes through the stages
+struct BatchEncode {
+    BatchEncode(const BatchJob &job, Image::EncodingLevel level, Image::PngProfile profile, const std::string &channels, bool fec)
+        : job(job.cover, job.embed, job.output, level, profile, channels, fec, log, err), result(0) {
+    }
+
+    // Each job gets its own log, so that jobs running at the same time don't get their lines mixed up
+    std::ostringstream log, err;
+    FileEncodeJob job;
+    int result;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Encodes every job of a manifest. The steps of an encode run in separate stages with their own workers, so that one
+// job's key is derived while the next one is loaded and the one before is saved. Jobs are reported as they finish, and
+// the rest still run if one fails.
+int batch_encode(const std::vector<BatchJob> &jobs, const std::array<std::uint8_t, 32> &password, Image::EncodingLevel level, Image::PngProfile profile, const std::string &channels, bool fec, const StageWorkers &workers, std::size_t cache_size) {
+    using clock = std::chrono::steady_clock;
+
+    // Jobs run at the same time, so two of them writing the same file would clobber each other
+    std::set<std::string> outputs;
+    for (auto &job : jobs) {
+        if (!outputs.insert(fs::absolute(job.output).lexically_normal().string()).second) {
+            std::cerr << "ERROR: '" << job.output << "' is the output of more than one job" << std::endl;
+            return -1;
+        }
+    }
+
+    // The biggest covers go first, so that the jobs left at the end are small ones and all the stages run dry at about the same time
+    std::vector<std::size_t> order(jobs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return jobs[a].cover_size > jobs[b].cover_size; });
+
+    // Jobs that share a cover share its decoded pixels, each copies them only as it embeds
+    std::unique_ptr<CoverCache> cache;
+    if (cache_size)
+        cache = std::make_unique<CoverCache>(cache_size);
+
+    std::vector<std::unique_ptr<BatchEncode>> batch;
+    for (auto i : order) {
+        batch.push_back(std::make_unique<BatchEncode>(jobs[i], level, profile, channels, fec));
+        batch.back()->job.cache = cache.get();
+    }
+
+    std::mutex mutex;
+    std::size_t done = 0, failed = 0, total_pixels = 0, total_embed = 0;
+    auto start = clock::now();
+
+    // A stage skips the jobs that failed in an earlier one. Queues hold one job per worker of the stage after them,
+    // which is enough to keep it busy, and bounds how many images are in memory at a time.
+    Pipeline<std::unique_ptr<BatchEncode>> pipeline;
+
+    pipeline.add_stage(workers.load, workers.load, [](std::unique_ptr<BatchEncode> &batch_job) {
+        batch_job->start = clock::now();
+        auto &job = batch_job->job;
+        batch_job->result = generate_salt(job) < 0 || load_cover(job) < 0 || read_embed(job) < 0 || pack_embed(job) < 0 ? -1 : 0;
+    });
+
+    pipeline.add_stage(workers.key, workers.key, [&](std::unique_ptr<BatchEncode> &batch_job) {
+        if (batch_job->result == 0)
+            batch_job->job.key = generate_key(password, batch_job->job.salt);
+    });
+
+    pipeline.add_stage(workers.embed, workers.embed, [](std::unique_ptr<BatchEncode> &batch_job) {
+        if (batch_job->result == 0)
+            batch_job->result = open_output(batch_job->job) < 0 ? -1 : embed_payload(batch_job->job);
+    });
+
+    pipeline.add_stage(workers.save, workers.save, [&](std::unique_ptr<BatchEncode> &batch_job) {
+        auto &job = batch_job->job;
+
+        if (batch_job->result == 0)
+            batch_job->result = save_cover(job);
+
+        auto seconds = std::chrono::duration<double>(clock::now() - batch_job->start).count();
+        auto pixels  = std::size_t(job.image.w()) * job.image.h();
+
+        // Only one save worker reports at a time
+        std::lock_guard<std::mutex> lock(mutex);
+        done++;
+
+        if (batch_job->result < 0) {
+            failed++;
+
+            auto message = batch_job->err.str();
+            if (message.rfind("ERROR: ", 0) == 0)
+                message.erase(0, 7);
 
-    // Decrypt the data
-    auto padded_data = new std::uint8_t[header.size];
-    aes.cbc_decrypt(encrypted_data.get(), header.size, padded_data);
+            std::cerr << "ERROR: [" << done << "/" << jobs.size() << "] " << job.cover << ": " << message << std::flush;
+        }
+        else {
+            total_pixels += pixels;
+            total_embed  += job.size;
+
+            std::cout << "* [" << done << "/" << jobs.size() << "] " << job.cover << " -> " << job.output << ": " << data_size(job.size)
+                      << " in " << std::fixed << std::setprecision(1) << seconds * 1000 << " ms, "
+                      << pixels / seconds / 1e6 << " Mpixels/s" << std::endl;
+        }
 
-    std::cout << "* Successfully decrypted the embed" << std::endl;
+        // The image isn't needed anymore, so don't keep it until the whole batch is done
+        batch_job.reset();
+    });
 
-    // Find how much padding to strip
-    std::uint8_t left = padded_data[header.size - 1];
-    std::size_t size  = header.size - left;
+    pipeline.run(batch);
 
-    std::cout << "* Decrypted embed size: " << data_size(size) << std::endl;
+    auto seconds = std::chrono::duration<double>(clock::now() - start).count();
 
-    // Calculate the CRC32 hash
-    CRC32 crc;
-    crc.update(padded_data, size);
+    std::cout << "* Encoded " << jobs.size() - failed << " of " << jobs.size() << " jobs in " << std::fixed << std::setprecision(2) << seconds << " s: "
+              << (jobs.size() - failed) / seconds << " jobs/s, " << total_pixels / seconds / 1e6 << " Mpixels/s, "
+              << data_size(static_cast<std::size_t>(total_embed / seconds)) << "/s of embeds" << std::endl;
+
+    if (cache && cache->hits())
+        std::cout << "* Reused decoded covers for " << cache->hits() << " of " << cache->hits() + cache->misses() << " jobs" << std::endl;
+
+    return failed ? -1 : 0;
+}
 
-    // Make sure that the data matches
-    if (crc.get_hash() != header.hash) {
-        std::cerr << "ERROR: File is corrupted!" << std::endl;
+int inspect(Image &image, const std::array<std::uint8_t, 32> &password) {
+    Header header;
+    std::uint8_t key[32], iv[16];
+
+    if (read_header(image, password, header, key, iv, false, std::cout, std::cerr) < 0)
         return -1;
+
+    std::cout << "* Embed name: " << header_name(header) << std::endl;
+    std::cout << "* Encrypted embed size: " << data_size(header.size) << std::endl;
+    std::cout << "* Encoding level: " << level_to_str[header.level] << std::endl;
+    std::cout << "* Channels: " << channels_to_str(header.flags & 0xf, image.c()) << std::endl;
+    std::cout << "* Error correction: " << (header.flags & fec_flag ? "Reed-Solomon (255, 239)" : "none") << std::endl;
+
+    if (header.shards) {
+        std::cout << "* Shard: " << (header.shard + 1) << " of " << int(header.shards) << " (set " << std::hex << std::setw(8) << std::setfill('0') << header.set << std::dec << ")" << std::endl;
+        std::cout << "* Parity shards: " << int(header.parity) << ", whole embed size: " << data_size(header.total) << std::endl;
     }
 
-    std::cout << "* CRC32 checksum matches" << std::endl;
+    return 0;
+}
 
-    // If the output path is empty, just use the embedded file name
-    if (output.empty())
-        output = name;
+// Writes an extracted embed out
+int write_embed(const std::string &output, const std::vector<std::uint8_t> &data, std::ostream &log, std::ostream &err) {
+    if (is_stdio(output)) {
+        binary_stdio();
+
+        if (!std::cout.write(reinterpret_cast<const char*>(data.data()), data.size()).flush()) {
+            err << "ERROR: Unable to write the embed to stdout" << std::endl;
+            return WriteFailed;
+        }
+
+        log << "* Successfully wrote to stdout" << std::endl;
+        return Decoded;
+    }
 
-    // Open the output file
     std::ofstream file(output, std::ios::out | std::ios::binary);
     if (!file.is_open()) {
-        std::cerr << "ERROR: Unable to save file '" << output << "'" << std::endl;
-        return -1;
+        err << "ERROR: Unable to save file '" << output << "'" << std::endl;
+        return WriteFailed;
     }
 
-    // Write the data
-    file.write(reinterpret_cast<char*>(padded_data), size);
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
     file.close();
 
-    delete[] padded_data;
+    if (!file) {
+        err << "ERROR: Unable to save file '" << output << "'" << std::endl;
+        return WriteFailed;
+    }
+
+    log << "* Successfully wrote to " << output << std::endl;
 
-    std::cout << "* Successfully wrote to " << output << std::endl;
+    return Decoded;
+}
 
-    return 0;
+// The embed's name, or one made from the image's when it was embedded without a name, such as from stdin
+std::string embed_name(const Header &header, const std::string &image) {
+    auto name = header_name(header);
+    if (!name.empty())
+        return name;
+
+    return is_stdio(image) ? "embed" : fs::path(image).filename().string() + ".embed";
+}
+
+// Decodes an embed from one image, or from the shards of one in a set of images given in any order. The images are loaded
+// and their shards extracted in parallel, then put back together in order.
+int decode(const std::vector<std::string> &paths, const std::array<std::uint8_t, 32> &password, std::string output) {
+    auto count = paths.size();
+
+    // With the embed going to stdout, the progress goes to stderr
+    std::ostream &log = is_stdio(output) ? std::cerr : std::cout;
+
+    // An image from stdin is read whole before anything is decoded
+    std::vector<std::uint8_t> piped;
+    bool too_big;
+
+    if (std::count_if(paths.begin(), paths.end(), is_stdio) > 1) {
+        std::cerr << "ERROR: Only one image can come from stdin" << std::endl;
+        return Unreadable;
+    }
+
+    if (std::any_of(paths.begin(), paths.end(), is_stdio) && !read_input("-", piped, SIZE_MAX, too_big)) {
+        std::cerr << "ERROR: Failed to read image from stdin" << std::endl;
+        return Unreadable;
+    }
+
+    std::vector<Header> headers(count);
+    std::vector<std::vector<std::uint8_t>> shards(count);
+    std::vector<std::ostringstream> logs(count), errs(count);
+    std::vector<int> results(count);
+
+    // Only the rows holding the header are loaded up front, the rest are decoded once the header says where the embed is
+    ThreadPool::shared().parallel_for(count, [&](std::size_t i) {
+        Image image;
+        if (is_stdio(paths[i]) ? !image.load(piped.data(), piped.size()) : !image.load(paths[i], header_region)) {
+            errs[i] << "ERROR: Failed to load image " << paths[i] << std::endl;
+            results[i] = Unreadable;
+            return;
+        }
+
+        results[i] = extract(image, password, headers[i], shards[i], logs[i], errs[i]);
+    });
+
+    std::size_t first = count;
+    for (std::size_t i = 0; i < count; i++) {
+        if (count > 1)
+            log << "* Image: " << paths[i] << std::endl;
+
+        log << logs[i].str();
+        std::cerr << errs[i].str();
+
+        if (results[i] == Decoded && first == count)
+            first = i;
+    }
+
+    // With parity, images that couldn't be decoded are only lost shards
+    if (first == count)
+        return results.front();
+
+    auto &header = headers[first];
+
+    if (count == 1 && !header.shards) {
+        // If the output path is empty, just use the embedded file name
+        if (output.empty())
+            output = embed_name(header, paths[first]);
+
+        return write_embed(output, shards.front(), log, std::cerr);
+    }
+
+    // Every image has to be a different shard of the same embed
+    std::vector<std::size_t> order(header.shards, count);
+
+    for (std::size_t i = 0; i < count; i++) {
+        if (results[i] != Decoded) {
+            if (!header.parity)
+                return results[i];
+            continue;
+        }
+
+        auto &other = headers[i];
+
+        if (!other.shards) {
+            std::cerr << "ERROR: " << paths[i] << " holds a whole embed, not a shard" << std::endl;
+            return Corrupt;
+        }
+
+        if (other.set != header.set || other.shards != header.shards || other.parity != header.parity || other.total != header.total) {
+            std::cerr << "ERROR: " << paths[i] << " holds a shard of a different embed than " << paths[first] << std::endl;
+            return Corrupt;
+        }
+
+        if (order[other.shard] != count) {
+            std::cerr << "ERROR: " << paths[order[other.shard]] << " and " << paths[i] << " both hold shard " << (other.shard + 1) << std::endl;
+            return Corrupt;
+        }
+
+        order[other.shard] = i;
+    }
+
+    std::size_t data_shards = header.shards - header.parity;
+    std::vector<std::uint8_t> data;
+
+    if (!header.parity) {
+        // Without parity, all of the shards have to be there
+        for (std::size_t s = 0; s < order.size(); s++) {
+            if (order[s] == count) {
+                std::cerr << "ERROR: Missing shard " << (s + 1) << " of " << order.size() << std::endl;
+                return Corrupt;
+            }
+        }
+
+        for (auto i : order) {
+            data.insert(data.end(), shards[i].begin(), shards[i].end());
+            shards[i] = std::vector<std::uint8_t>();
+        }
+    }
+    else {
+        auto length  = shards[first].size();
+        auto present = std::count_if(order.begin(), order.end(), [count](std::size_t i) { return i != count; });
+
+        if (std::size_t(present) < data_shards) {
+            std::cerr << "ERROR: Only " << present << " of the " << int(header.shards) << " shards could be read, " << data_shards << " are needed" << std::endl;
+            return Corrupt;
+        }
+
+        if (length * data_shards < header.total) {
+            std::cerr << "ERROR: Shards are too small to hold the embed, corrupt file" << std::endl;
+            return Corrupt;
+        }
+
+        // Fill in the data shards that are missing
+        std::vector<std::vector<std::uint8_t>> lost(header.shards);
+        std::vector<std::uint8_t*> pointers(header.shards);
+        std::unique_ptr<bool[]> have(new bool[header.shards]);
+
+        for (std::size_t s = 0; s < order.size(); s++) {
+            have[s] = order[s] != count;
+
+            if (have[s] && shards[order[s]].size() != length) {
+                std::cerr << "ERROR: Shard " << (s + 1) << " in " << paths[order[s]] << " is " << shards[order[s]].size() << " bytes, but shard "
+                          << (header.shard + 1) << " in " << paths[first] << " is " << length << ", corrupt file" << std::endl;
+                return Corrupt;
+            }
+
+            if (!have[s] && s < data_shards)
+                lost[s].resize(length);
+
+            pointers[s] = have[s] ? shards[order[s]].data() : lost[s].data();
+        }
+
+        auto missing = std::count(have.get(), have.get() + data_shards, false);
+        if (missing) {
+            if (!ReedSolomon(data_shards, header.parity).reconstruct(pointers.data(), have.get(), length)) {
+                std::cerr << "ERROR: Unable to rebuild the " << missing << " missing data shards, corrupt file" << std::endl;
+                return Corrupt;
+            }
+
+            log << "* Rebuilt " << missing << " missing data shards with Reed-Solomon" << std::endl;
+        }
+
+        data.reserve(length * data_shards);
+        for (std::size_t s = 0; s < data_shards; s++)
+            data.insert(data.end(), pointers[s], pointers[s] + length);
+    }
+
+    if (data.size() < header.total || (!header.parity && data.size() != header.total)) {
+        std::cerr << "ERROR: Joined shards are " << data.size() << " bytes instead of " << header.total << ", corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    data.resize(header.total);
+
+    log << "* Joined " << data_shards << " shards, embed size: " << data_size(data.size()) << std::endl;
+
+    if (output.empty())
+        output = embed_name(header, paths[first]);
+
+    return write_embed(output, data, log, std::cerr);
+}
+
+// Lets jobs run while the memory they are expected to need fits in a budget. A job that needs more than the whole budget
+// waits until it is the only one running.
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(std::size_t budget) : left(budget), budget(budget) {
+    }
+
+    std::size_t acquire(std::size_t size) {
+        size = std::min(size, budget);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return left >= size; });
+        left -= size;
+
+        return size;
+    }
+
+    void release(std::size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            left += size;
+        }
+        cv.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t left, budget;
+};
+
+// Extensions of the images that batch-decode looks at
+static const char *cover_extensions[] = {".png", ".qoi", ".bmp", ".pgm", ".ppm", ".pam", ".tga"};
+
+// Decodes every image under a directory, threads of them at a time, into output_dir. Each embed is written under the name in
+// its header, in the same subdirectory as its image, with a number added when two embeds of the same run have the same name.
+int batch_decode(const std::string &input_dir, const std::string &output_dir, const std::array<std::uint8_t, 32> &password, unsigned int threads, std::size_t memory) {
+    using clock = std::chrono::steady_clock;
+
+    std::vector<fs::path> images;
+    std::error_code error;
+
+    for (fs::recursive_directory_iterator it(input_dir, error), end; !error && it != end; it.increment(error)) {
+        auto extension = it->path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return std::tolower(c); });
+
+        if (it->is_regular_file() && std::find(std::begin(cover_extensions), std::end(cover_extensions), extension) != std::end(cover_extensions))
+            images.push_back(it->path());
+    }
+
+    if (error) {
+        std::cerr << "ERROR: Unable to read directory '" << input_dir << "': " << error.message() << std::endl;
+        return -1;
+    }
+
+    std::sort(images.begin(), images.end());
+
+    MemoryBudget budget(memory);
+    std::mutex mutex;
+    std::set<fs::path> written;
+    std::size_t done = 0, total_embed = 0;
+    std::size_t counts[5] = {};
+    auto start = clock::now();
+
+    auto run = [&](std::size_t i) {
+        auto &path = images[i];
+        auto relative = path.lexically_relative(input_dir);
+
+        std::ostringstream log, err;
+        Header header;
+        std::vector<std::uint8_t> data;
+        int result = Unreadable;
+
+        // Count each image as its whole decoded size twice over, once for the pixels and once for the embed buffers
+        unsigned int w, h, c, d;
+        if (Image::info(path.string(), w, h, c, d)) {
+            auto reserved = budget.acquire(std::size_t(w) * h * c * (d / 8) * 2);
+
+            Image image;
+            if (image.load(path.string(), header_region))
+                result = extract(image, password, header, data, log, err);
+            else
+                err << "ERROR: Failed to load image " << path.string() << std::endl;
+
+            budget.release(reserved);
+        }
+        else {
+            err << "ERROR: Failed to load image " << path.string() << std::endl;
+        }
+
+        fs::path output;
+
+        if (result == Decoded) {
+            // The name comes from the image, so only its last component is used
+            auto name = fs::path(header_name(header)).filename();
+            if (name.empty() || name == "." || name == "..")
+                name = path.filename().string() + ".embed";
+
+            // Shards are numbered after the embed's name, so that joining the data shards in name order gives back the embed.
+            // Parity shards are numbered apart, and the padding is cut off the last data shard.
+            if (header.shards) {
+                auto data_shards = header.shards - header.parity;
+                bool is_parity   = header.shard >= data_shards;
+
+                std::ostringstream number;
+                number << (is_parity ? ".p" : ".") << std::setw(3) << std::setfill('0') << (is_parity ? header.shard - data_shards : header.shard) + 1;
+                name += number.str();
+
+                if (header.parity && !is_parity)
+                    data.resize(std::min<std::size_t>(data.size(), header.total - std::min<std::size_t>(header.total, std::size_t(header.shard) * data.size())));
+            }
+
+            auto directory = fs::path(output_dir) / relative.parent_path();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                output = directory / name;
+                for (unsigned int n = 2; !written.insert(output).second; n++)
+                    output = directory / (name.stem().string() + " (" + std::to_string(n) + ")" + name.extension().string());
+            }
+
+            fs::create_directories(directory, error);
+            result = write_embed(output.string(), data, log, err);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        done++;
+        counts[-result]++;
+
+        if (result == Decoded) {
+            total_embed += data.size();
+            std::cout << "* [" << done << "/" << images.size() << "] " << relative.string() << " -> " << output.string() << ": " << data_size(data.size()) << std::endl;
+            return;
+        }
+
+        auto message = err.str();
+        if (message.rfind("ERROR: ", 0) == 0)
+            message.erase(0, 7);
+
+        std::cerr << "ERROR: [" << done << "/" << images.size() << "] " << relative.string() << ": " << message << std::flush;
+    };
+
+    // The calling thread decodes images too
+    if (threads > 1) {
+        ThreadPool pool(threads - 1);
+        pool.parallel_for(images.size(), run);
+    }
+    else {
+        for (std::size_t i = 0; i < images.size(); i++)
+            run(i);
+    }
+
+    auto seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << "* Decoded " << counts[Decoded] << " of " << images.size() << " images in " << std::fixed << std::setprecision(2) << seconds << " s, "
+              << data_size(total_embed) << " of embeds" << std::endl;
+    std::cout << "* Wrong password or no embed: " << counts[-WrongPassword] << std::endl;
+    std::cout << "* Corrupt: " << counts[-Corrupt] << std::endl;
+    std::cout << "* Unreadable: " << counts[-Unreadable] << std::endl;
+    std::cout << "* Unable to write: " << counts[-WriteFailed] << std::endl;
+
+    return counts[Decoded] == images.size() ? 0 : -1;
 }
 
 int main(int argc, char **argv) {
@@ -278,37 +1054,168 @@ int main(int argc, char **argv) {
 
     encode_command.add_argument("-i", "--input")
         .required()
-        .help("specify the input image.");
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .help("specify the input image, - for stdin, or several to split the embed across.");
 
     encode_command.add_argument("-o", "--output")
         .required()
-        .help("specify the output image.");
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .help("specify the output image, - for a PNG on stdout, one for each input image.");
 
     encode_command.add_argument("-e", "--embed")
         .required()
-        .help("specify the file to embed.");
+        .help("specify the file to embed, - for stdin.");
 
     encode_command.add_argument("-p", "--passwd")
         .help("specify the encryption password.");
 
+    encode_command.add_argument("--parity")
+        .default_value(0u)
+        .scan<'u', unsigned int>()
+        .help("specify how many of the output images hold Reed-Solomon parity, so that the embed survives losing that many.");
+
+    encode_command.add_argument("--fec")
+        .default_value(false)
+        .implicit_value(true)
+        .help("add Reed-Solomon error correction, so that the embed survives some of its bytes being changed.");
+
+    encode_command.add_argument("--png-profile")
+        .default_value(std::string("balanced"))
+        .help("specify the PNG compression profile (fast, balanced or small).");
+
+    encode_command.add_argument("--channels")
+        .default_value(std::string("all"))
+        .help("specify the channels to embed into, any of r, g, b and a (y and a for greyscale images) or all.");
+
+    // Batch encode subcommand
+    argparse::ArgumentParser batch_encode_command("batch-encode");
+    batch_encode_command.add_description("Encodes the embed-files of a manifest into their images, several at a time");
+
+    batch_encode_command.add_argument("-m", "--manifest")
+        .required()
+        .help("specify the manifest, one \"cover embed output\" job per line.");
+
+    batch_encode_command.add_argument("-p", "--passwd")
+        .help("specify the encryption password, used for every job.");
+
+    batch_encode_command.add_argument("-j", "--jobs")
+        .default_value(0u)
+        .scan<'u', unsigned int>()
+        .help("specify how many threads to split between the stages, at least 4, 0 for one per hardware thread.");
+
+    batch_encode_command.add_argument("--stage-workers")
+        .default_value(std::string(""))
+        .help("specify the threads of the load, key, embed and save stages, like 2,4,2,4, instead of splitting --jobs.");
+
+    batch_encode_command.add_argument("--cache")
+        .default_value(512u)
+        .scan<'u', unsigned int>()
+        .help("specify how many MiB of decoded covers to keep for jobs that reuse a cover, 0 to decode every one.");
+
+    batch_encode_command.add_argument("--fec")
+        .default_value(false)
+        .implicit_value(true)
+        .help("add Reed-Solomon error correction to every embed.");
+
+    batch_encode_command.add_argument("--png-profile")
+        .default_value(std::string("balanced"))
+        .help("specify the PNG compression profile (fast, balanced or small).");
+
+    batch_encode_command.add_argument("--channels")
+        .default_value(std::string("all"))
+        .help("specify the channels to embed into, any of r, g, b and a (y and a for greyscale images) or all.");
+
     // Decode subcommand
     argparse::ArgumentParser decode_command("decode");
     decode_command.add_description("Decodes and extracts an embed-file from an image");
 
     decode_command.add_argument("-i", "--input")
         .required()
-        .help("specify the input image.");
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .help("specify the input image, - for stdin, or the images holding the shards of an embed in any order.");
 
     decode_command.add_argument("-o", "--output")
         .default_value(std::string(""))
-        .help("specify the output file.");
+        .help("specify the output file, - for stdout.");
 
     decode_command.add_argument("-p", "--passwd")
         .help("specify the encryption password.");
 
+    // Batch decode subcommand
+    argparse::ArgumentParser batch_decode_command("batch-decode");
+    batch_decode_command.add_description("Decodes and extracts the embed-files of every image in a directory, several at a time");
+
+    batch_decode_command.add_argument("-i", "--input")
+        .required()
+        .help("specify the directory of images, searched recursively.");
+
+    batch_decode_command.add_argument("-o", "--output")
+        .default_value(std::string("."))
+        .help("specify the directory to write the embed-files to.");
+
+    batch_decode_command.add_argument("-p", "--passwd")
+        .help("specify the encryption password, used for every image.");
+
+    batch_decode_command.add_argument("-j", "--jobs")
+        .default_value(0u)
+        .scan<'u', unsigned int>()
+        .help("specify how many images to decode at a time, 0 for one per hardware thread.");
+
+    batch_decode_command.add_argument("--memory")
+        .default_value(1024u)
+        .scan<'u', unsigned int>()
+        .help("specify how many MiB the images being decoded at a time may take up.");
+
+    // Inspect subcommand
+    argparse::ArgumentParser inspect_command("inspect");
+    inspect_command.add_description("Shows the name, size and level of the embed-file in an image");
+
+    inspect_command.add_argument("-i", "--input")
+        .required()
+        .help("specify the input image, - for stdin.");
+
+    inspect_command.add_argument("-p", "--passwd")
+        .help("specify the encryption password.");
+
+    argparse::ArgumentParser serve_command("serve");
+    serve_command.add_description("Serves encodes and decodes over a Unix domain socket until interrupted");
+
+    serve_command.add_argument("-s", "--socket")
+        .required()
+        .help("specify the path of the socket to listen on.");
+
+    serve_command.add_argument("-w", "--workers")
+        .default_value(0u)
+        .scan<'u', unsigned int>()
+        .help("specify how many requests to run at a time, 0 for one per hardware thread.");
+
+    serve_command.add_argument("-q", "--queue")
+        .default_value(0u)
+        .scan<'u', unsigned int>()
+        .help("specify how many requests can wait for a worker before connections stop being read, 0 for twice the workers.");
+
+    serve_command.add_argument("--max-request")
+        .default_value(256u)
+        .scan<'u', unsigned int>()
+        .help("specify the most MiB a request can take up.");
+
+    serve_command.add_argument("--max-connections")
+        .default_value(64u)
+        .scan<'u', unsigned int>()
+        .help("specify how many connections can be open at once, each holds a thread and up to --max-request MiB.");
+
+    serve_command.add_argument("--cache")
+        .default_value(512u)
+        .scan<'u', unsigned int>()
+        .help("specify how many MiB of decoded covers to keep for encodes that reuse a cover, 0 to decode every one.");
+
     // Add the subcommands to the main parser
     program.add_subparser(encode_command);
+    program.add_subparser(batch_encode_command);
+    program.add_subparser(batch_decode_command);
     program.add_subparser(decode_command);
+    program.add_subparser(inspect_command);
+    program.add_subparser(serve_command);
 
     // Parse the arguments
     try {
@@ -320,66 +1227,175 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    // Generates the password hash from a user string
-    auto generate_password = [](const argparse::ArgumentParser &parser) -> std::array<std::uint8_t, 32> {
+    // Generates the password hash from a user string, prompting on stderr when stdout carries data
+    auto generate_password = [](const argparse::ArgumentParser &parser, bool piped_out = false) -> std::array<std::uint8_t, 32> {
         // Get the password string
         std::string str;
         if (parser.is_used("--passwd")) {
             str = parser.get<std::string>("--passwd");
         }
         else {
-            std::cout << "Password: ";
+            (piped_out ? std::cerr : std::cout) << "Password: " << std::flush;
             std::getline(std::cin, str);
         }
 
-        // Generate the password hash
-        std::array<std::uint8_t, 32> hash;
-        SHA256 sha;
-        sha.update(str.data(), str.size());
-        sha.finish();
-        sha.get_hash(hash.data());
+        return hash_password(str);
+    };
+
+    // Data on stdin leaves no way to prompt for the password
+    auto password_given = [](const argparse::ArgumentParser &parser, bool piped_in) {
+        if (piped_in && !parser.is_used("--passwd")) {
+            std::cerr << "ERROR: The password has to be given with -p when reading from stdin" << std::endl;
+            return false;
+        }
 
-        return hash;
+        return true;
     };
 
     // Encode command
     if (program.is_subcommand_used("encode")) {
-        auto input_path  = encode_command.get<std::string>("--input");
-        auto output_path = encode_command.get<std::string>("--output");
-        auto embed_path  = encode_command.get<std::string>("--embed");
+        auto input_paths  = encode_command.get<std::vector<std::string>>("--input");
+        auto output_paths = encode_command.get<std::vector<std::string>>("--output");
+        auto embed_path   = encode_command.get<std::string>("--embed");
+        auto parity       = encode_command.get<unsigned int>("--parity");
+        auto fec          = encode_command.get<bool>("--fec");
+        auto profile_str  = encode_command.get<std::string>("--png-profile");
+        auto channels     = encode_command.get<std::string>("--channels");
+
+        Image::PngProfile profile;
+        if (!parse_profile(profile_str, profile))
+            return -1;
 
-        // Attempt to load the image
-        Image image;
-        if (!image.load(input_path)) {
-            std::cerr << "ERROR: Failed to load image " << input_path << std::endl;
+        bool piped_in  = is_stdio(embed_path) || std::any_of(input_paths.begin(), input_paths.end(), is_stdio);
+        bool piped_out = std::any_of(output_paths.begin(), output_paths.end(), is_stdio);
+
+        if (!password_given(encode_command, piped_in))
             return -1;
+
+        // Generate the password hash, before the image is loaded so the key can be derived alongside it
+        auto password = generate_password(encode_command, piped_out);
+
+        // Encode the image, or split the embed across the images
+        if (input_paths.size() == 1 && output_paths.size() == 1 && !parity) {
+            if (encode(input_paths.front(), password, embed_path, output_paths.front(), LEVEL, profile, channels, fec) < 0)
+                return -1;
         }
+        else if (encode_shards(input_paths, password, embed_path, output_paths, parity, LEVEL, profile, channels, fec) < 0) {
+            return -1;
+        }
+    }
 
-        // Generate the password hash
-        auto password = generate_password(encode_command);
+    // Batch encode command
+    else if (program.is_subcommand_used("batch-encode")) {
+        auto manifest    = batch_encode_command.get<std::string>("--manifest");
+        auto jobs        = batch_encode_command.get<unsigned int>("--jobs");
+        auto profile_str = batch_encode_command.get<std::string>("--png-profile");
+        auto channels    = batch_encode_command.get<std::string>("--channels");
+        auto fec         = batch_encode_command.get<bool>("--fec");
+        auto cache       = batch_encode_command.get<unsigned int>("--cache");
+
+        Image::PngProfile profile;
+        if (!parse_profile(profile_str, profile))
+            return -1;
+
+        std::vector<BatchJob> batch;
+        if (!read_manifest(manifest, batch))
+            return -1;
+
+        if (!jobs)
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+
+        auto workers = default_stage_workers(jobs);
+        if (batch_encode_command.is_used("--stage-workers") && !parse_stage_workers(batch_encode_command.get<std::string>("--stage-workers"), workers))
+            return -1;
+
+        auto password = generate_password(batch_encode_command);
 
-        // Encode the image
-        if (encode(image, password, embed_path, output_path, LEVEL) < 0)
+        if (batch_encode(batch, password, LEVEL, profile, channels, fec, workers, std::size_t(cache) * 1024 * 1024) < 0)
             return -1;
     }
 
     // Decode command
     else if (program.is_subcommand_used("decode")) {
-        auto input_path  = decode_command.get<std::string>("--input");
+        auto input_paths = decode_command.get<std::vector<std::string>>("--input");
         auto output_path = decode_command.get<std::string>("--output");
 
-        // Attempt to load the image
+        if (!password_given(decode_command, std::any_of(input_paths.begin(), input_paths.end(), is_stdio)))
+            return -1;
+
+        // Generate the password hash
+        auto password = generate_password(decode_command, is_stdio(output_path));
+
+        // Decode the image, or join the shards of the images
+        if (decode(input_paths, password, output_path) < 0)
+            return -1;
+    }
+
+    // Batch decode command
+    else if (program.is_subcommand_used("batch-decode")) {
+        auto input_dir  = batch_decode_command.get<std::string>("--input");
+        auto output_dir = batch_decode_command.get<std::string>("--output");
+        auto jobs       = batch_decode_command.get<unsigned int>("--jobs");
+        auto memory     = batch_decode_command.get<unsigned int>("--memory");
+
+        if (!jobs)
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+
+        if (!memory) {
+            std::cerr << "ERROR: --memory has to be at least 1" << std::endl;
+            return -1;
+        }
+
+        auto password = generate_password(batch_decode_command);
+
+        if (batch_decode(input_dir, output_dir, password, jobs, std::size_t(memory) * 1024 * 1024) < 0)
+            return -1;
+    }
+
+    // Inspect command
+    else if (program.is_subcommand_used("inspect")) {
+        auto input_path = inspect_command.get<std::string>("--input");
+
+        if (!password_given(inspect_command, is_stdio(input_path)))
+            return -1;
+
+        // Attempt to load the image, only the rows holding the header are needed
         Image image;
-        if (!image.load(input_path)) {
+        std::vector<std::uint8_t> piped;
+        bool too_big;
+
+        if (is_stdio(input_path) ? !read_input(input_path, piped, SIZE_MAX, too_big) || !image.load(piped.data(), piped.size()) : !image.load(input_path, header_region)) {
             std::cerr << "ERROR: Failed to load image " << input_path << std::endl;
             return -1;
         }
 
         // Generate the password hash
-        auto password = generate_password(decode_command);
+        auto password = generate_password(inspect_command);
+
+        if (inspect(image, password) < 0)
+            return -1;
+    }
+
+    // Serve command
+    else if (program.is_subcommand_used("serve")) {
+        auto socket_path = serve_command.get<std::string>("--socket");
+        auto workers     = serve_command.get<unsigned int>("--workers");
+        auto queue       = serve_command.get<unsigned int>("--queue");
+        auto max_request = serve_command.get<unsigned int>("--max-request");
+        auto connections = serve_command.get<unsigned int>("--max-connections");
+        auto cache       = serve_command.get<unsigned int>("--cache");
+
+        if (!workers)
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        if (!queue)
+            queue = workers * 2;
+
+        if (!connections) {
+            std::cerr << "ERROR: --max-connections has to be at least 1" << std::endl;
+            return -1;
+        }
 
-        // Decode the image
-        if (decode(image, password, output_path) < 0)
+        if (serve(socket_path, workers, queue, std::size_t(max_request) * 1024 * 1024, connections, std::size_t(cache) * 1024 * 1024) < 0)
             return -1;
     }
 
@@ -0,0 +1,100 @@
+#include "mapped_file.hpp"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFile::MappedFile() : file(-1), pointer(nullptr), length(0) {
+}
+
+bool MappedFile::open(const std::string &path, bool writable) {
+    close();
+
+    file = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (file < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(file, &info) || info.st_size <= 0)
+        return false;
+
+    auto mapped = mmap(nullptr, info.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+    if (mapped == MAP_FAILED)
+        return false;
+
+    pointer = static_cast<std::uint8_t*>(mapped);
+    length  = info.st_size;
+
+    return true;
+}
+
+bool MappedFile::flush() {
+    return pointer && !msync(pointer, length, MS_SYNC);
+}
+
+void MappedFile::close() {
+    if (pointer)
+        munmap(pointer, length);
+    if (file >= 0)
+        ::close(file);
+
+    file    = -1;
+    pointer = nullptr;
+    length  = 0;
+}
+
+#elif defined(_WIN32)
+
+MappedFile::MappedFile() : file(INVALID_HANDLE_VALUE), mapping(NULL), pointer(nullptr), length(0) {
+}
+
+bool MappedFile::open(const std::string &path, bool writable) {
+    close();
+
+    file = CreateFileA(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0)
+        return false;
+
+    mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+        return false;
+
+    auto mapped = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+    if (!mapped)
+        return false;
+
+    pointer = static_cast<std::uint8_t*>(mapped);
+    length  = size.QuadPart;
+
+    return true;
+}
+
+bool MappedFile::flush() {
+    return pointer && FlushViewOfFile(pointer, length) && FlushFileBuffers(file);
+}
+
+void MappedFile::close() {
+    if (pointer)
+        UnmapViewOfFile(pointer);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+
+    file    = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    pointer = nullptr;
+    length  = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#if defined(__linux__) || defined(__APPLE__)
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#error "Unsupported OS"
+#endif
+
+// A whole file mapped into memory, writes to a writable mapping go straight to the file
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+    bool open(const std::string &path, bool writable);
+
+    // Makes sure that everything written has reached the file
+    bool flush();
+
+    std::uint8_t *data() const { return pointer; }
+    std::size_t size() const { return length; }
+
+private:
+    void close();
+
+#if defined(__linux__) || defined(__APPLE__)
+    int file;
+#elif defined(_WIN32)
+    HANDLE file, mapping;
+#endif
+
+    std::uint8_t *pointer;
+    std::size_t length;
+};
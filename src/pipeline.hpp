@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+// A queue that blocks pushes while it is full, and pops while it is empty until it is closed
+template <typename T> class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity) : capacity(capacity), closed(false) {
+    }
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return items.size() < capacity; });
+
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+
+        if (items.empty())
+            return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+
+        return true;
+    }
+
+    // No more items will be pushed
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    std::deque<T> items;
+    std::size_t capacity;
+    bool closed;
+
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+};
+
+// Passes items through a series of stages, each with its own worker threads and a bounded queue in front of it.
+// Different items are in different stages at the same time, and a slow stage holds back the ones before it
+// rather than letting items pile up in memory. Items come out of the last stage in the order they finish.
+template <typename T> class Pipeline
+{
+public:
+    // Stages run in the order they are added, capacity is how many items can wait in front of the stage
+    void add_stage(unsigned int workers, std::size_t capacity, std::function<void(T&)> fn) {
+        stages.push_back({std::max(1u, workers), std::max<std::size_t>(1, capacity), std::move(fn)});
+    }
+
+    // Feeds every item through all the stages, and returns once they are all through
+    void run(std::vector<T> &items) {
+        if (stages.empty())
+            return;
+
+        std::vector<std::unique_ptr<BoundedQueue<T*>>> queues;
+        for (auto &stage : stages)
+            queues.push_back(std::make_unique<BoundedQueue<T*>>(stage.capacity));
+
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<std::atomic<unsigned int>>> running;
+
+        for (std::size_t s = 0; s < stages.size(); s++) {
+            running.push_back(std::make_unique<std::atomic<unsigned int>>(stages[s].workers));
+
+            for (unsigned int w = 0; w < stages[s].workers; w++) {
+                threads.emplace_back([&, s]() {
+                    auto *next = s + 1 < queues.size() ? queues[s + 1].get() : nullptr;
+
+                    T *item;
+                    while (queues[s]->pop(item)) {
+                        stages[s].fn(*item);
+                        if (next)
+                            next->push(item);
+                    }
+
+                    // The last worker of a stage to finish lets the next stage know that nothing else is coming
+                    if (--*running[s] == 0 && next)
+                        next->close();
+                });
+            }
+        }
+
+        for (auto &item : items)
+            queues.front()->push(&item);
+        queues.front()->close();
+
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+private:
+    struct Stage {
+        unsigned int workers;
+        std::size_t capacity;
+        std::function<void(T&)> fn;
+    };
+
+    std::vector<Stage> stages;
+};
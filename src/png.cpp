@@ -0,0 +1,271 @@
+#include "png.hpp"
+#include "crc32.hpp"
+#include "deflate.hpp"
+#include "png_filter.hpp"
+#include "thread_pool.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+static const std::size_t max_idat_size = 1024 * 1024;
+static const std::size_t rows_per_band = 16;
+static const std::size_t input_size    = 64 * 1024;
+
+static const std::uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+static std::uint32_t read_u32(const std::uint8_t *data) {
+    return (std::uint32_t(data[0]) << 24) | (std::uint32_t(data[1]) << 16) | (std::uint32_t(data[2]) << 8) | data[3];
+}
+
+PngWriter::PngWriter(int level, int strategy, int filter) : level(level), strategy(strategy), filter(filter) {
+}
+
+bool PngWriter::write(const std::string &path, const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels, unsigned int depth) {
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    return write(file, pixels, width, height, channels, depth);
+}
+
+bool PngWriter::write(std::ostream &out, const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels, unsigned int depth) {
+    static const std::uint8_t color_types[5] = {0, 0, 4, 2, 6};
+
+    if (channels < 1 || channels > 4 || (depth != 8 && depth != 16))
+        return false;
+
+    // Filters work on whole pixels, whatever their depth
+    auto bpp = channels * depth / 8;
+
+    // Filter the image, each row is prefixed with its filter type. The buffer is kept for the next image written on the same thread.
+    thread_local std::vector<std::uint8_t> filtered;
+    filtered.resize((std::size_t(width) * bpp + 1) * height);
+    filter_image(pixels, width, height, bpp, filtered.data());
+
+#ifdef FAST_DEFLATE
+    auto compressed = fast_deflate(filtered.data(), filtered.size(), level);
+#else
+    auto compressed = parallel_deflate(filtered.data(), filtered.size(), level, strategy);
+#endif
+    if (compressed.empty())
+        return false;
+
+    std::uint8_t header[13] = {
+        std::uint8_t(width  >> 24), std::uint8_t(width  >> 16), std::uint8_t(width  >> 8), std::uint8_t(width),
+        std::uint8_t(height >> 24), std::uint8_t(height >> 16), std::uint8_t(height >> 8), std::uint8_t(height),
+        std::uint8_t(depth),    // Bit depth
+        color_types[channels],  // Color type
+        0, 0, 0                 // Compression, filter and interlace methods
+    };
+
+    out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    write_chunk(out, "IHDR", header, sizeof(header));
+
+    for (std::size_t i = 0; i < compressed.size(); i += max_idat_size)
+        write_chunk(out, "IDAT", compressed.data() + i, std::min(max_idat_size, compressed.size() - i));
+
+    write_chunk(out, "IEND", nullptr, 0);
+
+    return out.good();
+}
+
+void PngWriter::filter_image(const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int bpp, std::uint8_t *out) {
+    std::size_t stride = std::size_t(width) * bpp;
+    std::vector<std::uint8_t> zeros(stride);
+
+    // Rows only depend on the unfiltered row above, so bands of rows can be filtered independently
+    std::size_t bands = (height + rows_per_band - 1) / rows_per_band;
+
+    ThreadPool::shared().parallel_for(bands, [&](std::size_t band) {
+        std::vector<std::uint8_t> buffer(stride);
+
+        auto first = band * rows_per_band;
+        auto last  = std::min<std::size_t>(height, first + rows_per_band);
+
+        for (auto y = first; y < last; y++) {
+            auto row  = pixels + y * stride;
+            auto prev = y ? row - stride : zeros.data();
+            auto dest = out + y * (stride + 1);
+
+            int type = filter;
+
+            if (type < 0) {
+                // Try all the filters, and keep the best
+                unsigned int best_cost = ~0u;
+
+                for (int t = 0; t < 5; t++) {
+                    auto cost = png_filter_row(row, prev, stride, bpp, t, buffer.data());
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        type = t;
+                    }
+                }
+            }
+
+            dest[0] = type;
+            png_filter_row(row, prev, stride, bpp, type, dest + 1);
+        }
+    });
+}
+
+void PngWriter::write_chunk(std::ostream &out, const char *type, const std::uint8_t *data, std::size_t size) {
+    std::uint8_t length[4] = {std::uint8_t(size >> 24), std::uint8_t(size >> 16), std::uint8_t(size >> 8), std::uint8_t(size)};
+
+    CRC32 crc;
+    crc.update(type, 4);
+    crc.update(data, size);
+
+    auto hash = crc.get_hash();
+    std::uint8_t checksum[4] = {std::uint8_t(hash >> 24), std::uint8_t(hash >> 16), std::uint8_t(hash >> 8), std::uint8_t(hash)};
+
+    out.write(reinterpret_cast<const char*>(length), 4);
+    out.write(type, 4);
+    out.write(reinterpret_cast<const char*>(data), size);
+    out.write(reinterpret_cast<const char*>(checksum), 4);
+}
+
+PngReader::PngReader() : width(0), height(0), channels(0), depth(0), stream(), stream_open(false), idat_left(0) {
+}
+
+PngReader::~PngReader() {
+    if (stream_open)
+        inflateEnd(&stream);
+}
+
+bool PngReader::open(const std::string &path) {
+    file.open(path, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    std::uint8_t magic[8];
+    if (!file.read(reinterpret_cast<char*>(magic), sizeof(magic)) || !std::equal(magic, magic + 8, signature))
+        return false;
+
+    // The header always comes first
+    std::uint32_t length;
+    char type[4];
+    std::uint8_t header[13];
+
+    if (!read_chunk(length, type) || std::memcmp(type, "IHDR", 4) || length != sizeof(header))
+        return false;
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || !file.ignore(4))
+        return false;
+
+    width  = read_u32(header);
+    height = read_u32(header + 4);
+    depth  = header[8];
+
+    // Bit depth, color type, compression, filter and interlace methods
+    if ((depth != 8 && depth != 16) || header[10] || header[11] || header[12])
+        return false;
+
+    switch (header[9]) {
+        case 0: channels = 1; break;
+        case 4: channels = 2; break;
+        case 2: channels = 3; break;
+        case 6: channels = 4; break;
+        default: return false;
+    }
+
+    if (!width || !height)
+        return false;
+
+    // Skip ahead to the image data
+    while (read_chunk(length, type)) {
+        if (!std::memcmp(type, "IDAT", 4)) {
+            if (inflateInit(&stream) != Z_OK)
+                return false;
+
+            stream_open = true;
+            idat_left   = length;
+
+            input.resize(input_size);
+            prev.assign(std::size_t(width) * channels * depth / 8, 0);
+            return true;
+        }
+
+        // Transparency is left to stb, as is anything else critical that isn't understood
+        if (!std::memcmp(type, "tRNS", 4) || !std::memcmp(type, "IEND", 4) || !(type[0] & 0x20))
+            return false;
+
+        if (!file.ignore(std::streamsize(length) + 4))
+            return false;
+    }
+
+    return false;
+}
+
+bool PngReader::read_rows(std::uint8_t *out, unsigned int count) {
+    auto bpp    = channels * depth / 8;
+    auto stride = std::size_t(width) * bpp;
+
+    for (unsigned int i = 0; i < count; i++, out += stride) {
+        // Inflate the filter type, and then the row straight into place
+        std::uint8_t type;
+        if (!inflate_into(&type, 1) || type > 4 || !inflate_into(out, stride))
+            return false;
+
+        png_unfilter_row(out, prev.data(), stride, bpp, type);
+        std::copy_n(out, stride, prev.data());
+    }
+
+    return true;
+}
+
+bool PngReader::read_chunk(std::uint32_t &length, char type[4]) {
+    std::uint8_t header[8];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)))
+        return false;
+
+    length = read_u32(header);
+    std::copy_n(header + 4, 4, type);
+
+    return true;
+}
+
+bool PngReader::inflate_into(std::uint8_t *out, std::size_t size) {
+    if (!stream_open)
+        return false;
+
+    stream.next_out  = out;
+    stream.avail_out = size;
+
+    while (stream.avail_out) {
+        if (!stream.avail_in && !refill())
+            return false;
+
+        int result = inflate(&stream, Z_NO_FLUSH);
+
+        if (result == Z_STREAM_END)
+            return !stream.avail_out;
+        if (result != Z_OK)
+            return false;
+    }
+
+    return true;
+}
+
+bool PngReader::refill() {
+    // Move on to the next IDAT chunk, the image data ends at the first chunk that isn't one
+    while (!idat_left) {
+        std::uint32_t length;
+        char type[4];
+
+        if (!file.ignore(4) || !read_chunk(length, type) || std::memcmp(type, "IDAT", 4))
+            return false;
+
+        idat_left = length;
+    }
+
+    auto size = std::min<std::size_t>(idat_left, input.size());
+    if (!file.read(reinterpret_cast<char*>(input.data()), size))
+        return false;
+
+    idat_left -= size;
+
+    stream.next_in  = input.data();
+    stream.avail_in = size;
+
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <ostream>
+#include <fstream>
+#include <vector>
+
+#include "zlib/zlib.h"
+
+class PngWriter
+{
+public:
+    // zlib level and strategy, and the PNG filter to use for every row (-1 picks the best of all 5 per row)
+    PngWriter(int level, int strategy, int filter);
+
+    // Writes an 8 or 16-bit image with 1 to 4 channels, 16-bit samples are big-endian like in the PNG itself
+    bool write(const std::string &path, const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels, unsigned int depth = 8);
+    bool write(std::ostream &out, const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels, unsigned int depth = 8);
+
+private:
+    void filter_image(const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int bpp, std::uint8_t *out);
+    void write_chunk(std::ostream &out, const char *type, const std::uint8_t *data, std::size_t size);
+
+    int level, strategy, filter;
+};
+
+class PngReader
+{
+public:
+    PngReader();
+    ~PngReader();
+
+    PngReader(const PngReader&) = delete;
+    PngReader &operator=(const PngReader&) = delete;
+
+    // Reads the image header, only non-interlaced 8 and 16-bit grey, grey-alpha, RGB and RGBA images without a tRNS chunk are supported
+    bool open(const std::string &path);
+
+    // Decodes the next count rows into out, each w()*c()*d()/8 bytes long (16-bit samples are left big-endian)
+    bool read_rows(std::uint8_t *out, unsigned int count);
+
+    unsigned int w() const { return width; }
+    unsigned int h() const { return height; }
+    unsigned int c() const { return channels; }
+    unsigned int d() const { return depth; }
+
+private:
+    bool read_chunk(std::uint32_t &length, char type[4]);
+    bool inflate_into(std::uint8_t *out, std::size_t size);
+    bool refill();
+
+    std::ifstream file;
+    unsigned int width, height, channels, depth;
+
+    z_stream stream;
+    bool stream_open;
+    std::uint32_t idat_left;             // Bytes left to read in the current IDAT chunk
+    std::vector<std::uint8_t> input;     // Compressed data read from the IDAT chunks
+    std::vector<std::uint8_t> prev;      // Last unfiltered row
+};
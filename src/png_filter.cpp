@@ -0,0 +1,382 @@
+#include "png_filter.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PNG_FILTER_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 and SSSE3 kernels are compiled with target attributes and picked at runtime
+#if defined(PNG_FILTER_SSE2) && defined(__GNUC__)
+#define PNG_FILTER_DISPATCH
+#include <immintrin.h>
+#endif
+
+static std::uint8_t paeth(int a, int b, int c) {
+    int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+// Filters bytes [start, size) of a row, returning their cost
+static unsigned int filter_scalar(const std::uint8_t *row, const std::uint8_t *prev, std::size_t start, std::size_t size, unsigned int bpp, int type, std::uint8_t *out) {
+    unsigned int cost = 0;
+
+    for (auto i = start; i < size; i++) {
+        int a = i >= bpp ? row [i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+
+        std::uint8_t value;
+        switch (type) {
+            case 0:  value = row[i]; break;
+            case 1:  value = row[i] - a; break;
+            case 2:  value = row[i] - b; break;
+            case 3:  value = row[i] - ((a + b) >> 1); break;
+            default: value = row[i] - paeth(a, b, c); break;
+        }
+
+        out[i] = value;
+        cost  += std::abs(static_cast<std::int8_t>(value));
+    }
+
+    return cost;
+}
+
+#ifdef PNG_FILTER_SSE2
+// Filters a row of 4 byte pixels 16 bytes at a time from i (past the first pixel), returns where it stopped
+static std::size_t filter_sse2(const std::uint8_t *row, const std::uint8_t *prev, std::size_t i, std::size_t size, int type, std::uint8_t *out, unsigned int &cost) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row  + i));
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row  + i - 4));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i - 4));
+        __m128i predictor;
+
+        switch (type) {
+            case 0: predictor = zero; break;
+            case 1: predictor = a; break;
+            case 2: predictor = b; break;
+
+            // (a + b) >> 1, pavgb rounds up so take the carry back out
+            case 3:
+                predictor = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+                break;
+
+            default: {
+                __m128i halves[2];
+
+                for (int h = 0; h < 2; h++) {
+                    __m128i a16 = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+                    __m128i b16 = h ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+                    __m128i c16 = h ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+
+                    // pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+                    __m128i bc = _mm_sub_epi16(b16, c16);
+                    __m128i ac = _mm_sub_epi16(a16, c16);
+                    __m128i pc = _mm_add_epi16(ac, bc);
+                    __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(_mm_setzero_si128(), bc));
+                    __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(_mm_setzero_si128(), ac));
+                    pc = _mm_max_epi16(pc, _mm_sub_epi16(_mm_setzero_si128(), pc));
+
+                    // a if pa <= pb and pa <= pc, otherwise b if pb <= pc, otherwise c
+                    __m128i not_a   = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+                    __m128i use_c   = _mm_cmpgt_epi16(pb, pc);
+                    __m128i bc_pick = _mm_or_si128(_mm_and_si128(use_c, c16), _mm_andnot_si128(use_c, b16));
+
+                    halves[h] = _mm_or_si128(_mm_and_si128(not_a, bc_pick), _mm_andnot_si128(not_a, a16));
+                }
+
+                predictor = _mm_packus_epi16(halves[0], halves[1]);
+                break;
+            }
+        }
+
+        __m128i value = _mm_sub_epi8(x, predictor);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), value);
+
+        // Sum of the absolute values of the signed bytes
+        __m128i sign = _mm_cmpgt_epi8(zero, value);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_sub_epi8(_mm_xor_si128(value, sign), sign), zero));
+    }
+
+    cost += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+    return i;
+}
+#endif
+
+#ifdef PNG_FILTER_DISPATCH
+// Same as filter_sse2, 32 bytes at a time
+__attribute__((target("avx2")))
+static std::size_t filter_avx2(const std::uint8_t *row, const std::uint8_t *prev, std::size_t i, std::size_t size, int type, std::uint8_t *out, unsigned int &cost) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row  + i));
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row  + i - 4));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i - 4));
+        __m256i predictor;
+
+        switch (type) {
+            case 0: predictor = zero; break;
+            case 1: predictor = a; break;
+            case 2: predictor = b; break;
+
+            case 3:
+                predictor = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+                break;
+
+            default: {
+                __m256i halves[2];
+
+                // Unpacking and packing both work per 128-bit lane, so the bytes end up back in order
+                for (int h = 0; h < 2; h++) {
+                    __m256i a16 = h ? _mm256_unpackhi_epi8(a, zero) : _mm256_unpacklo_epi8(a, zero);
+                    __m256i b16 = h ? _mm256_unpackhi_epi8(b, zero) : _mm256_unpacklo_epi8(b, zero);
+                    __m256i c16 = h ? _mm256_unpackhi_epi8(c, zero) : _mm256_unpacklo_epi8(c, zero);
+
+                    __m256i bc = _mm256_sub_epi16(b16, c16);
+                    __m256i ac = _mm256_sub_epi16(a16, c16);
+                    __m256i pa = _mm256_abs_epi16(bc);
+                    __m256i pb = _mm256_abs_epi16(ac);
+                    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(ac, bc));
+
+                    __m256i not_a   = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+                    __m256i use_c   = _mm256_cmpgt_epi16(pb, pc);
+                    __m256i bc_pick = _mm256_blendv_epi8(b16, c16, use_c);
+
+                    halves[h] = _mm256_blendv_epi8(a16, bc_pick, not_a);
+                }
+
+                predictor = _mm256_packus_epi16(halves[0], halves[1]);
+                break;
+            }
+        }
+
+        __m256i value = _mm256_sub_epi8(x, predictor);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), value);
+
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(value), zero));
+    }
+
+    __m128i total = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    cost += _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(total, total));
+    return i;
+}
+
+static bool has_avx2() {
+    static const bool result = __builtin_cpu_supports("avx2");
+    return result;
+}
+
+static bool has_ssse3() {
+    static const bool result = __builtin_cpu_supports("ssse3");
+    return result;
+}
+#endif
+
+unsigned int png_filter_row(const std::uint8_t *row, const std::uint8_t *prev, std::size_t size, unsigned int bpp, int type, std::uint8_t *out) {
+    // The first pixel has nothing to its left, and is always done here
+    std::size_t start = std::min<std::size_t>(bpp, size);
+    unsigned int cost = filter_scalar(row, prev, 0, start, bpp, type, out);
+
+    if (bpp == 4) {
+#ifdef PNG_FILTER_DISPATCH
+        if (has_avx2())
+            start = filter_avx2(row, prev, start, size, type, out, cost);
+#endif
+#ifdef PNG_FILTER_SSE2
+        start = filter_sse2(row, prev, start, size, type, out, cost);
+#endif
+    }
+
+    return cost + filter_scalar(row, prev, start, size, bpp, type, out);
+}
+
+// Reverses bytes [start, size) of a row
+static void unfilter_scalar(std::uint8_t *row, const std::uint8_t *prev, std::size_t start, std::size_t size, unsigned int bpp, int type) {
+    for (auto i = start; i < size; i++) {
+        int a = i >= bpp ? row [i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+
+        switch (type) {
+            case 1:  row[i] += a; break;
+            case 2:  row[i] += b; break;
+            case 3:  row[i] += (a + b) >> 1; break;
+            case 4:  row[i] += paeth(a, b, c); break;
+        }
+    }
+}
+
+#ifdef PNG_FILTER_SSE2
+// Sub, Average and Paeth depend on the pixel to the left, so these go one 3 or 4 byte pixel at a time
+// 3 byte pixels are loaded with a stray 4th byte (unless that would read past the row), which only ever ends up in an unused lane
+template <unsigned int bpp>
+static inline __m128i load_pixel(const std::uint8_t *p, std::size_t left) {
+    std::uint32_t value = 0;
+
+    if (bpp == 4 || left >= 4)
+        std::memcpy(&value, p, 4);
+    else
+        std::memcpy(&value, p, 3);
+
+    return _mm_cvtsi32_si128(value);
+}
+
+template <unsigned int bpp>
+static inline void store_pixel(std::uint8_t *p, __m128i pixel) {
+    std::uint32_t value = _mm_cvtsi128_si32(pixel);
+
+    if (bpp == 4) {
+        std::memcpy(p, &value, 4);
+    }
+    else {
+        std::memcpy(p, &value, 2);
+        p[2] = value >> 16;
+    }
+}
+
+static void unfilter_up_sse2(std::uint8_t *row, const std::uint8_t *prev, std::size_t size) {
+    std::size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row  + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(x, b));
+    }
+
+    for (; i < size; i++)
+        row[i] += prev[i];
+}
+
+template <unsigned int bpp>
+static void unfilter_sub_sse2(std::uint8_t *row, std::size_t size) {
+    __m128i a = _mm_setzero_si128();
+
+    for (std::size_t i = 0; i < size; i += bpp) {
+        a = _mm_add_epi8(load_pixel<bpp>(row + i, size - i), a);
+        store_pixel<bpp>(row + i, a);
+    }
+}
+
+template <unsigned int bpp>
+static void unfilter_avg_sse2(std::uint8_t *row, const std::uint8_t *prev, std::size_t size) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+
+    for (std::size_t i = 0; i < size; i += bpp) {
+        __m128i b = load_pixel<bpp>(prev + i, size - i);
+
+        // (a + b) >> 1, pavgb rounds up so take the carry back out
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(load_pixel<bpp>(row + i, size - i), avg);
+        store_pixel<bpp>(row + i, a);
+    }
+}
+
+// Picks the Paeth predictor from 16-bit a, b, c and the absolute values pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+static inline __m128i paeth_select(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc) {
+    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i use_c = _mm_cmpgt_epi16(pb, pc);
+    __m128i bc    = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+
+    return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+
+template <unsigned int bpp>
+static void unfilter_paeth_sse2(std::uint8_t *row, const std::uint8_t *prev, std::size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+
+    for (std::size_t i = 0; i < size; i += bpp) {
+        __m128i b  = _mm_unpacklo_epi8(load_pixel<bpp>(prev + i, size - i), zero);
+        __m128i bc = _mm_sub_epi16(b, c);
+        __m128i ac = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(ac, bc);
+
+        __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+        __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+        __m128i predictor = _mm_packus_epi16(paeth_select(a, b, c, pa, pb, pc), zero);
+        __m128i x = _mm_add_epi8(load_pixel<bpp>(row + i, size - i), predictor);
+        store_pixel<bpp>(row + i, x);
+
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+    }
+}
+#endif
+
+#ifdef PNG_FILTER_DISPATCH
+// Same as unfilter_paeth_sse2, with pabsw for the absolute values
+template <unsigned int bpp>
+__attribute__((target("ssse3")))
+static void unfilter_paeth_ssse3(std::uint8_t *row, const std::uint8_t *prev, std::size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+
+    for (std::size_t i = 0; i < size; i += bpp) {
+        __m128i b  = _mm_unpacklo_epi8(load_pixel<bpp>(prev + i, size - i), zero);
+        __m128i bc = _mm_sub_epi16(b, c);
+        __m128i ac = _mm_sub_epi16(a, c);
+
+        __m128i pa = _mm_abs_epi16(bc);
+        __m128i pb = _mm_abs_epi16(ac);
+        __m128i pc = _mm_abs_epi16(_mm_add_epi16(ac, bc));
+
+        __m128i predictor = _mm_packus_epi16(paeth_select(a, b, c, pa, pb, pc), zero);
+        __m128i x = _mm_add_epi8(load_pixel<bpp>(row + i, size - i), predictor);
+        store_pixel<bpp>(row + i, x);
+
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+    }
+}
+#endif
+
+void png_unfilter_row(std::uint8_t *row, const std::uint8_t *prev, std::size_t size, unsigned int bpp, int type) {
+#ifdef PNG_FILTER_SSE2
+    if (type == 2) {
+        unfilter_up_sse2(row, prev, size);
+        return;
+    }
+
+    if (bpp == 3 || bpp == 4) {
+        switch (type) {
+            case 1:
+                bpp == 3 ? unfilter_sub_sse2<3>(row, size) : unfilter_sub_sse2<4>(row, size);
+                return;
+
+            case 3:
+                bpp == 3 ? unfilter_avg_sse2<3>(row, prev, size) : unfilter_avg_sse2<4>(row, prev, size);
+                return;
+
+            case 4:
+#ifdef PNG_FILTER_DISPATCH
+                if (has_ssse3()) {
+                    bpp == 3 ? unfilter_paeth_ssse3<3>(row, prev, size) : unfilter_paeth_ssse3<4>(row, prev, size);
+                    return;
+                }
+#endif
+                bpp == 3 ? unfilter_paeth_sse2<3>(row, prev, size) : unfilter_paeth_sse2<4>(row, prev, size);
+                return;
+        }
+    }
+#endif
+
+    unfilter_scalar(row, prev, 0, size, bpp, type);
+}
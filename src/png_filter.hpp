@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Filters a row of size bytes with a PNG filter type, prev is the row above (all zeros for the first row).
+// Returns the sum of the absolute values of the filtered bytes, the lower it is the better the row should compress.
+unsigned int png_filter_row(const std::uint8_t *row, const std::uint8_t *prev, std::size_t size, unsigned int bpp, int type, std::uint8_t *out);
+
+// Reverses a PNG filter type in place, prev is the unfiltered row above (all zeros for the first row)
+void png_unfilter_row(std::uint8_t *row, const std::uint8_t *prev, std::size_t size, unsigned int bpp, int type);
@@ -0,0 +1,237 @@
+#include "qoi.hpp"
+#include "mapped_file.hpp"
+
+#include <fstream>
+#include <cstring>
+
+static const std::uint8_t magic[4]   = {'q', 'o', 'i', 'f'};
+static const std::uint8_t padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static const std::size_t header_size = 14;
+static const std::size_t max_pixels  = 400000000; // As in the reference decoder
+
+static const std::uint8_t op_index = 0x00;
+static const std::uint8_t op_diff  = 0x40;
+static const std::uint8_t op_luma  = 0x80;
+static const std::uint8_t op_run   = 0xc0;
+static const std::uint8_t op_rgb   = 0xfe;
+static const std::uint8_t op_rgba  = 0xff;
+
+// Pixels are kept as RGBA packed into a word, so that they can be compared and copied in one go
+static std::uint32_t pack(const std::uint8_t *rgba) {
+    std::uint32_t value;
+    std::memcpy(&value, rgba, 4);
+    return value;
+}
+
+static unsigned int hash(const std::uint8_t *rgba) {
+    return (rgba[0] * 3 + rgba[1] * 5 + rgba[2] * 7 + rgba[3] * 11) % 64;
+}
+
+static void write_u32(std::uint8_t *out, std::uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static std::uint32_t read_u32(const std::uint8_t *data) {
+    return (std::uint32_t(data[0]) << 24) | (std::uint32_t(data[1]) << 16) | (std::uint32_t(data[2]) << 8) | data[3];
+}
+
+bool is_qoi(const std::uint8_t *data, std::size_t size) {
+    return size >= sizeof(magic) && !std::memcmp(data, magic, sizeof(magic));
+}
+
+std::vector<std::uint8_t> qoi_encode(const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels) {
+    std::size_t count = std::size_t(width) * height;
+    if ((channels != 3 && channels != 4) || !count || count > max_pixels)
+        return {};
+
+    // Big enough for every pixel to need a full RGBA op
+    std::vector<std::uint8_t> out(header_size + count * 5 + sizeof(padding));
+    auto *p = out.data();
+
+    std::memcpy(p, magic, sizeof(magic));
+    write_u32(p + 4, width);
+    write_u32(p + 8, height);
+    p[12] = channels;
+    p[13] = 0; // sRGB with linear alpha
+    p += header_size;
+
+    std::uint8_t index[64][4] = {};
+    std::uint8_t prev[4] = {0, 0, 0, 255};
+    std::uint8_t px[4]   = {0, 0, 0, 255};
+    unsigned int run = 0;
+
+    for (std::size_t i = 0; i < count; i++, pixels += channels) {
+        std::memcpy(px, pixels, channels);
+
+        if (pack(px) == pack(prev)) {
+            if (++run == 62 || i == count - 1) {
+                *p++ = op_run | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run) {
+            *p++ = op_run | (run - 1);
+            run = 0;
+        }
+
+        auto slot = hash(px);
+
+        if (pack(index[slot]) == pack(px)) {
+            *p++ = op_index | slot;
+        }
+        else if (px[3] != prev[3]) {
+            std::memcpy(index[slot], px, 4);
+
+            *p++ = op_rgba;
+            std::memcpy(p, px, 4);
+            p += 4;
+        }
+        else {
+            std::memcpy(index[slot], px, 4);
+
+            // Differences wrap around, like the decoder's additions do
+            auto dr = std::int8_t(px[0] - prev[0]);
+            auto dg = std::int8_t(px[1] - prev[1]);
+            auto db = std::int8_t(px[2] - prev[2]);
+            auto dr_dg = std::int8_t(dr - dg);
+            auto db_dg = std::int8_t(db - dg);
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *p++ = op_diff | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+            }
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                *p++ = op_luma | (dg + 32);
+                *p++ = ((dr_dg + 8) << 4) | (db_dg + 8);
+            }
+            else {
+                *p++ = op_rgb;
+                *p++ = px[0];
+                *p++ = px[1];
+                *p++ = px[2];
+            }
+        }
+
+        std::memcpy(prev, px, 4);
+    }
+
+    std::memcpy(p, padding, sizeof(padding));
+    p += sizeof(padding);
+
+    out.resize(p - out.data());
+    return out;
+}
+
+static bool read_header(const std::uint8_t *data, std::size_t size, unsigned int &width, unsigned int &height, unsigned int &channels) {
+    if (size < header_size || !is_qoi(data, size))
+        return false;
+
+    width    = read_u32(data + 4);
+    height   = read_u32(data + 8);
+    channels = data[12];
+
+    std::size_t count = std::size_t(width) * height;
+    return (channels == 3 || channels == 4) && data[13] <= 1 && count && count <= max_pixels;
+}
+
+bool qoi_decode(const std::uint8_t *data, std::size_t size, std::unique_ptr<std::uint8_t[]> &pixels, unsigned int &width, unsigned int &height, unsigned int &channels) {
+    if (size < header_size + sizeof(padding) || !read_header(data, size, width, height, channels))
+        return false;
+
+    std::size_t count = std::size_t(width) * height;
+
+    pixels.reset(new std::uint8_t[count * channels]);
+    auto *out = pixels.get();
+
+    // Ops never run into the padding at the end
+    auto *p   = data + header_size;
+    auto *end = data + size - sizeof(padding);
+
+    std::uint8_t index[64][4] = {};
+    std::uint8_t px[4] = {0, 0, 0, 255};
+    unsigned int run = 0;
+
+    for (std::size_t i = 0; i < count; i++, out += channels) {
+        if (run) {
+            run--;
+        }
+        else {
+            if (p >= end)
+                return false;
+
+            auto op = *p++;
+
+            if (op == op_rgb || op == op_rgba) {
+                auto n = op == op_rgb ? 3 : 4;
+                if (end - p < n)
+                    return false;
+
+                std::memcpy(px, p, n);
+                p += n;
+            }
+            else if ((op & 0xc0) == op_index) {
+                std::memcpy(px, index[op], 4);
+            }
+            else if ((op & 0xc0) == op_diff) {
+                px[0] += ((op >> 4) & 3) - 2;
+                px[1] += ((op >> 2) & 3) - 2;
+                px[2] += (op & 3) - 2;
+            }
+            else if ((op & 0xc0) == op_luma) {
+                if (p >= end)
+                    return false;
+
+                auto dg = (op & 0x3f) - 32;
+                auto dr_db = *p++;
+
+                px[0] += dg + (dr_db >> 4) - 8;
+                px[1] += dg;
+                px[2] += dg + (dr_db & 0x0f) - 8;
+            }
+            else {
+                run = op & 0x3f;
+            }
+
+            std::memcpy(index[hash(px)], px, 4);
+        }
+
+        std::memcpy(out, px, channels);
+    }
+
+    return true;
+}
+
+bool qoi_info(const std::string &path, unsigned int &width, unsigned int &height, unsigned int &channels) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+
+    std::uint8_t header[header_size];
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)))
+        return false;
+
+    return read_header(header, sizeof(header), width, height, channels);
+}
+
+bool qoi_write(const std::string &path, const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels) {
+    auto encoded = qoi_encode(pixels, width, height, channels);
+    if (encoded.empty())
+        return false;
+
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+
+    return file.good();
+}
+
+bool qoi_read(const std::string &path, std::unique_ptr<std::uint8_t[]> &pixels, unsigned int &width, unsigned int &height, unsigned int &channels) {
+    // Decoded straight out of a mapping, rather than reading the whole file into memory first
+    MappedFile file;
+    if (!file.open(path, false))
+        return false;
+
+    return qoi_decode(file.data(), file.size(), pixels, width, height, channels);
+}
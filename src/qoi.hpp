@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Whether data starts like a QOI image
+bool is_qoi(const std::uint8_t *data, std::size_t size);
+
+// Encodes an 8-bit RGB or RGBA image as QOI, returns nothing for any other channel count
+std::vector<std::uint8_t> qoi_encode(const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels);
+
+// Decodes a whole QOI image into pixels, in the channel count stored in its header (3 or 4). Fails on truncated or corrupt data.
+bool qoi_decode(const std::uint8_t *data, std::size_t size, std::unique_ptr<std::uint8_t[]> &pixels, unsigned int &width, unsigned int &height, unsigned int &channels);
+
+// Reads just the size of a QOI image from its header
+bool qoi_info(const std::string &path, unsigned int &width, unsigned int &height, unsigned int &channels);
+
+bool qoi_write(const std::string &path, const std::uint8_t *pixels, unsigned int width, unsigned int height, unsigned int channels);
+bool qoi_read(const std::string &path, std::unique_ptr<std::uint8_t[]> &pixels, unsigned int &width, unsigned int &height, unsigned int &channels);
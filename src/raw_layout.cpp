@@ -0,0 +1,197 @@
+#include "raw_layout.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <string>
+
+static std::uint32_t read_le16(const std::uint8_t *data) {
+    return data[0] | (data[1] << 8);
+}
+
+static std::uint32_t read_le32(const std::uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (std::uint32_t(data[3]) << 24);
+}
+
+// Reads a decimal number from a PNM/PAM header, skipping whitespace and comments before it
+static bool read_number(const std::uint8_t *data, std::size_t size, std::size_t &pos, unsigned int &value) {
+    while (pos < size && (std::isspace(data[pos]) || data[pos] == '#')) {
+        if (data[pos] == '#')
+            while (pos < size && data[pos] != '\n')
+                pos++;
+        else
+            pos++;
+    }
+
+    if (pos >= size || !std::isdigit(data[pos]))
+        return false;
+
+    std::uint64_t number = 0;
+    for (; pos < size && std::isdigit(data[pos]) && number <= 0xffffffff; pos++)
+        number = number * 10 + (data[pos] - '0');
+
+    value = number;
+    return number <= 0xffffffff;
+}
+
+static bool parse_bmp(const std::uint8_t *data, std::size_t size, RawLayout &layout) {
+    if (size < 54)
+        return false;
+
+    // Only the plain 24-bit variant, stb turns anything else into something that isn't in the file
+    auto header_size = read_le32(data + 14);
+    auto width       = std::int32_t(read_le32(data + 18));
+    auto height      = std::int32_t(read_le32(data + 22));
+
+    if (header_size < 40 || read_le16(data + 26) != 1 || read_le16(data + 28) != 24 || read_le32(data + 30) != 0)
+        return false;
+    if (width <= 0 || height == 0 || height == INT32_MIN)
+        return false;
+
+    layout.width      = width;
+    layout.height     = height < 0 ? -height : height;
+    layout.channels   = 3;
+    layout.depth      = 8;
+    layout.offset     = read_le32(data + 10);
+    layout.row_stride = (std::size_t(width) * 3 + 3) & ~std::size_t(3);
+    layout.bottom_up  = height > 0;
+
+    // Stored as BGR
+    layout.order[0] = 2; layout.order[1] = 1; layout.order[2] = 0;
+
+    return true;
+}
+
+static bool parse_pnm(const std::uint8_t *data, std::size_t size, RawLayout &layout) {
+    unsigned int width, height, maxval;
+    std::size_t pos = 2;
+
+    if (!read_number(data, size, pos, width) || !read_number(data, size, pos, height) || !read_number(data, size, pos, maxval))
+        return false;
+
+    // A single whitespace character comes before the pixels
+    if (pos >= size || !std::isspace(data[pos]))
+        return false;
+
+    layout.width      = width;
+    layout.height     = height;
+    layout.channels   = data[1] == '6' ? 3 : 1;
+    layout.depth      = maxval == 65535 ? 16 : 8;
+    layout.offset     = pos + 1;
+    layout.row_stride = std::size_t(width) * layout.channels * (layout.depth / 8);
+    layout.bottom_up  = false;
+
+    // Anything less than the full range could be pushed out of it by changing the low bits
+    return maxval == 255 || maxval == 65535;
+}
+
+static bool parse_pam(const std::uint8_t *data, std::size_t size, RawLayout &layout) {
+    unsigned int width = 0, height = 0, depth = 0, maxval = 0;
+    std::size_t pos = 2;
+
+    // Lines of keywords and values, up to ENDHDR
+    while (true) {
+        while (pos < size && std::isspace(data[pos]))
+            pos++;
+
+        std::string key;
+        for (; pos < size && !std::isspace(data[pos]); pos++)
+            key += char(data[pos]);
+
+        if (key.empty())
+            return false;
+
+        if (key == "ENDHDR") {
+            if (pos >= size || data[pos] != '\n')
+                return false;
+
+            pos++;
+            break;
+        }
+
+        bool ok = true;
+        if (key == "WIDTH")
+            ok = read_number(data, size, pos, width);
+        else if (key == "HEIGHT")
+            ok = read_number(data, size, pos, height);
+        else if (key == "DEPTH")
+            ok = read_number(data, size, pos, depth);
+        else if (key == "MAXVAL")
+            ok = read_number(data, size, pos, maxval);
+
+        // Skip the rest of the line, TUPLTYPE and comments included
+        while (pos < size && data[pos] != '\n')
+            pos++;
+
+        if (!ok)
+            return false;
+    }
+
+    if (depth < 1 || depth > 4 || (maxval != 255 && maxval != 65535))
+        return false;
+
+    layout.width      = width;
+    layout.height     = height;
+    layout.channels   = depth;
+    layout.depth      = maxval == 65535 ? 16 : 8;
+    layout.offset     = pos;
+    layout.row_stride = std::size_t(width) * depth * (layout.depth / 8);
+    layout.bottom_up  = false;
+
+    return true;
+}
+
+static bool parse_tga(const std::uint8_t *data, std::size_t size, RawLayout &layout) {
+    if (size < 18)
+        return false;
+
+    auto type       = data[2];
+    auto bits       = data[16];
+    auto descriptor = data[17];
+
+    // No color map, uncompressed true color or grey, and rows going left to right
+    if (data[1] || (descriptor & 0x10))
+        return false;
+    if (!(type == 2 && (bits == 24 || bits == 32)) && !(type == 3 && bits == 8))
+        return false;
+
+    layout.width      = read_le16(data + 12);
+    layout.height     = read_le16(data + 14);
+    layout.channels   = bits / 8;
+    layout.depth      = 8;
+    layout.offset     = 18 + data[0];
+    layout.row_stride = std::size_t(layout.width) * layout.channels;
+    layout.bottom_up  = !(descriptor & 0x20);
+
+    // Stored as BGR(A)
+    if (type == 2) {
+        layout.order[0] = 2; layout.order[2] = 0;
+    }
+
+    return true;
+}
+
+bool parse_raw_layout(const std::uint8_t *data, std::size_t size, bool tga, RawLayout &layout) {
+    if (size < 3)
+        return false;
+
+    for (unsigned int i = 0; i < 8; i++)
+        layout.order[i] = i;
+
+    bool ok;
+    if (data[0] == 'B' && data[1] == 'M')
+        ok = parse_bmp(data, size, layout);
+    else if (data[0] == 'P' && (data[1] == '5' || data[1] == '6'))
+        ok = parse_pnm(data, size, layout);
+    else if (data[0] == 'P' && data[1] == '7')
+        ok = parse_pam(data, size, layout);
+    else
+        ok = tga && parse_tga(data, size, layout);
+
+    if (!ok || !layout.width || !layout.height)
+        return false;
+
+    // All of the pixels have to be in the file
+    auto row = std::size_t(layout.width) * layout.channels * (layout.depth / 8);
+    return layout.row_stride >= row && layout.offset <= size && (size - layout.offset) / layout.row_stride >= layout.height - 1 &&
+           size - layout.offset - std::size_t(layout.height - 1) * layout.row_stride >= row;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Where the pixels of an uncompressed image file are, so that they can be read and written in place
+struct RawLayout {
+    unsigned int width, height;
+    unsigned int channels, depth;
+    std::size_t offset;       // File offset of the first row
+    std::size_t row_stride;   // Bytes from one row to the next, padding included
+    bool bottom_up;           // The last row comes first
+    std::uint8_t order[8];    // Where each byte of a pixel is in the file, in the order that stb loads them (RGBA, 16-bit big-endian)
+};
+
+// Reads the header of a 24-bit BMP, binary PGM/PPM, PAM or uncompressed 24/32-bit or grey TGA file.
+// Returns false for anything else, including the variants of those formats that can't be edited in place.
+// TGA files have no magic number, so they are only tried when tga is set (from the file extension).
+bool parse_raw_layout(const std::uint8_t *data, std::size_t size, bool tga, RawLayout &layout);
@@ -0,0 +1,480 @@
+#include "reed_solomon.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+
+// SSSE3 and AVX2 kernels are compiled with target attributes and picked at runtime
+#if (defined(__SSE2__) || defined(_M_X64)) && defined(__GNUC__)
+#define GF_DISPATCH
+#include <immintrin.h>
+#endif
+
+// Bytes of every shard done at a time, small enough that the outputs of a block stay in cache between inputs
+static const std::size_t block_size = 16 * 1024;
+
+static std::uint8_t exp_table[512];
+static std::uint8_t log_table[256];
+
+// Products of every byte with every byte, and the products of every byte with the low and high nibbles for the SIMD kernels
+static std::uint8_t mul_table[256][256];
+static std::uint8_t nibble_table[256][2][16];
+
+static void fill_tables() {
+    unsigned int x = 1;
+    for (unsigned int i = 0; i < 255; i++) {
+        exp_table[i] = x;
+        log_table[x] = i;
+
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+
+    // Doubled up, so that the sum of two logs can be looked up without a modulo
+    for (unsigned int i = 255; i < 512; i++)
+        exp_table[i] = exp_table[i - 255];
+
+    for (unsigned int a = 0; a < 256; a++) {
+        for (unsigned int b = 0; b < 256; b++)
+            mul_table[a][b] = a && b ? exp_table[log_table[a] + log_table[b]] : 0;
+
+        for (unsigned int n = 0; n < 16; n++) {
+            nibble_table[a][0][n] = mul_table[a][n];
+            nibble_table[a][1][n] = mul_table[a][n << 4];
+        }
+    }
+}
+
+static void build_tables() {
+    static std::once_flag built_tables;
+    std::call_once(built_tables, fill_tables);
+}
+
+std::uint8_t gf_mul(std::uint8_t a, std::uint8_t b) {
+    build_tables();
+    return mul_table[a][b];
+}
+
+std::uint8_t gf_inv(std::uint8_t a) {
+    build_tables();
+    return a ? exp_table[255 - log_table[a]] : 0;
+}
+
+// With add the products are xored into out, otherwise they replace it. in and out can be the same.
+template <bool add>
+static void mul_scalar(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size) {
+    auto *row = mul_table[c];
+    for (std::size_t i = 0; i < size; i++)
+        out[i] = add ? out[i] ^ row[in[i]] : row[in[i]];
+}
+
+#ifdef GF_DISPATCH
+// c * x is c * (low nibble of x) ^ c * (high nibble of x), both of which are looked up 16 at a time with pshufb.
+// Returns how many bytes were done.
+template <bool add>
+__attribute__((target("ssse3")))
+static std::size_t mul_ssse3(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size) {
+    const __m128i low  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nibble_table[c][0]));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nibble_table[c][1]));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    std::size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+
+        __m128i products = _mm_xor_si128(_mm_shuffle_epi8(low,  _mm_and_si128(x, mask)),
+                                         _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+
+        if (add)
+            products = _mm_xor_si128(products, _mm_loadu_si128(reinterpret_cast<const __m128i*>(out + i)));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), products);
+    }
+
+    return i;
+}
+
+// Same as mul_ssse3, 32 bytes at a time
+template <bool add>
+__attribute__((target("avx2")))
+static std::size_t mul_avx2(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size) {
+    const __m256i low  = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(nibble_table[c][0])));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(nibble_table[c][1])));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    std::size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+
+        __m256i products = _mm256_xor_si256(_mm256_shuffle_epi8(low,  _mm256_and_si256(x, mask)),
+                                            _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+
+        if (add)
+            products = _mm256_xor_si256(products, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + i)));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), products);
+    }
+
+    return i;
+}
+
+static bool has_avx2() {
+    static const bool result = __builtin_cpu_supports("avx2");
+    return result;
+}
+
+static bool has_ssse3() {
+    static const bool result = __builtin_cpu_supports("ssse3");
+    return result;
+}
+#endif
+
+template <bool add>
+static void mul_region(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size) {
+    build_tables();
+
+    std::size_t done = 0;
+
+#ifdef GF_DISPATCH
+    if (has_avx2())
+        done = mul_avx2<add>(c, in, out, size);
+    else if (has_ssse3())
+        done = mul_ssse3<add>(c, in, out, size);
+#endif
+
+    mul_scalar<add>(c, in + done, out + done, size - done);
+}
+
+void gf_mul_add(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size) {
+    // Nothing to add, or the bytes themselves
+    if (!c)
+        return;
+
+    if (c == 1) {
+        for (std::size_t i = 0; i < size; i++)
+            out[i] ^= in[i];
+        return;
+    }
+
+    mul_region<true>(c, in, out, size);
+}
+
+void gf_mul_region(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size) {
+    if (c == 1) {
+        if (in != out)
+            std::copy_n(in, size, out);
+        return;
+    }
+
+    mul_region<false>(c, in, out, size);
+}
+
+ReedSolomon::ReedSolomon(unsigned int data_shards, unsigned int parity_shards) : data_shards(data_shards), parity_shards(parity_shards) {
+    build_tables();
+
+    // 1 / (x_i + y_j), with x_i = i and y_j = parity_shards + j all different
+    matrix.resize(std::size_t(parity_shards) * data_shards);
+    for (unsigned int i = 0; i < parity_shards; i++)
+        for (unsigned int j = 0; j < data_shards; j++)
+            matrix[i * data_shards + j] = gf_inv(i ^ (parity_shards + j));
+}
+
+void ReedSolomon::apply(const std::vector<std::uint8_t> &coefficients, const std::vector<const std::uint8_t*> &inputs, const std::vector<std::uint8_t*> &outputs, std::size_t size) {
+    auto blocks = (size + block_size - 1) / block_size;
+
+    ThreadPool::shared().parallel_for(blocks, [&](std::size_t block) {
+        auto start = block * block_size;
+        auto count = std::min(block_size, size - start);
+
+        for (std::size_t i = 0; i < outputs.size(); i++) {
+            std::fill_n(outputs[i] + start, count, 0);
+
+            for (std::size_t j = 0; j < inputs.size(); j++)
+                gf_mul_add(coefficients[i * inputs.size() + j], inputs[j] + start, outputs[i] + start, count);
+        }
+    });
+}
+
+void ReedSolomon::encode(std::uint8_t *const *shards, std::size_t size) const {
+    std::vector<const std::uint8_t*> inputs(shards, shards + data_shards);
+    std::vector<std::uint8_t*> outputs(shards + data_shards, shards + data_shards + parity_shards);
+
+    apply(matrix, inputs, outputs, size);
+}
+
+bool ReedSolomon::reconstruct(std::uint8_t *const *shards, const bool *present, std::size_t size) const {
+    auto total = data_shards + parity_shards;
+
+    // Take the rows of the first data_shards shards there are
+    std::vector<unsigned int> rows;
+    for (unsigned int r = 0; r < total && rows.size() < data_shards; r++)
+        if (present[r])
+            rows.push_back(r);
+
+    if (rows.size() < data_shards)
+        return false;
+
+    // Invert the matrix that gave those shards from the data shards, by Gauss-Jordan elimination next to an identity matrix
+    auto n = data_shards;
+    std::vector<std::uint8_t> a(std::size_t(n) * n), inverse(std::size_t(n) * n, 0);
+
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int j = 0; j < n; j++)
+            a[i * n + j] = rows[i] < n ? rows[i] == j : matrix[(rows[i] - n) * n + j];
+
+        inverse[i * n + i] = 1;
+    }
+
+    for (unsigned int col = 0; col < n; col++) {
+        auto pivot = col;
+        while (pivot < n && !a[pivot * n + col])
+            pivot++;
+
+        if (pivot == n)
+            return false;
+
+        if (pivot != col) {
+            std::swap_ranges(&a[pivot * n], &a[pivot * n] + n, &a[col * n]);
+            std::swap_ranges(&inverse[pivot * n], &inverse[pivot * n] + n, &inverse[col * n]);
+        }
+
+        auto scale = gf_inv(a[col * n + col]);
+        for (unsigned int j = 0; j < n; j++) {
+            a[col * n + j]       = gf_mul(a[col * n + j], scale);
+            inverse[col * n + j] = gf_mul(inverse[col * n + j], scale);
+        }
+
+        for (unsigned int i = 0; i < n; i++) {
+            auto factor = a[i * n + col];
+            if (i == col || !factor)
+                continue;
+
+            for (unsigned int j = 0; j < n; j++) {
+                a[i * n + j]       ^= gf_mul(factor, a[col * n + j]);
+                inverse[i * n + j] ^= gf_mul(factor, inverse[col * n + j]);
+            }
+        }
+    }
+
+    // The missing data shards are their rows of the inverse times the shards there are
+    std::vector<const std::uint8_t*> inputs;
+    for (auto r : rows)
+        inputs.push_back(shards[r]);
+
+    std::vector<std::uint8_t> coefficients;
+    std::vector<std::uint8_t*> outputs;
+
+    for (unsigned int d = 0; d < data_shards; d++) {
+        if (present[d])
+            continue;
+
+        coefficients.insert(coefficients.end(), &inverse[d * n], &inverse[d * n] + n);
+        outputs.push_back(shards[d]);
+    }
+
+    apply(coefficients, inputs, outputs, size);
+
+    return true;
+}
+
+static const unsigned int fec_data   = 239;
+static const unsigned int fec_parity = 16;
+static const unsigned int fec_total  = fec_data + fec_parity;
+
+// Codewords done at a time by each task, their parity or syndrome rows stay in cache
+static const std::size_t fec_columns = 4096;
+
+std::size_t fec_size(std::size_t size) {
+    return (size + fec_data - 1) / fec_data * fec_total;
+}
+
+// (x - a^0)(x - a^1)...(x - a^15), highest power first
+static const std::uint8_t *fec_generator() {
+    static std::uint8_t generator[fec_parity + 1];
+    static std::once_flag built;
+
+    std::call_once(built, []() {
+        build_tables();
+
+        generator[0] = 1;
+        for (unsigned int i = 0; i < fec_parity; i++) {
+            generator[i + 1] = mul_table[exp_table[i]][generator[i]];
+            for (unsigned int k = i; k > 0; k--)
+                generator[k] ^= mul_table[exp_table[i]][generator[k - 1]];
+        }
+    });
+
+    return generator;
+}
+
+void fec_encode(std::uint8_t *buffer, std::size_t size) {
+    auto n = (size + fec_data - 1) / fec_data;
+    auto *generator = fec_generator();
+
+    // The last data row is filled out with zeros
+    std::fill(buffer + size, buffer + n * fec_data, 0);
+
+    auto slices = (n + fec_columns - 1) / fec_columns;
+
+    ThreadPool::shared().parallel_for(slices, [&](std::size_t slice) {
+        auto start = slice * fec_columns;
+        auto width = std::min(fec_columns, n - start);
+
+        // The remainders of dividing the codewords by the generator, one row per power, kept as a ring starting at first
+        std::vector<std::uint8_t> remainder(fec_parity * width, 0);
+        unsigned int first = 0;
+
+        for (unsigned int j = 0; j < fec_data; j++) {
+            auto *feedback = &remainder[first * width];
+            auto *row = buffer + j * n + start;
+
+            for (std::size_t w = 0; w < width; w++)
+                feedback[w] ^= row[w];
+
+            for (unsigned int k = 1; k < fec_parity; k++)
+                gf_mul_add(generator[k], feedback, &remainder[(first + k) % fec_parity * width], width);
+
+            gf_mul_region(generator[fec_parity], feedback, feedback, width);
+            first = (first + 1) % fec_parity;
+        }
+
+        for (unsigned int k = 0; k < fec_parity; k++)
+            std::copy_n(&remainder[(first + k) % fec_parity * width], width, buffer + (fec_data + k) * n + start);
+    });
+}
+
+// Finds and fixes the errors in a codeword whose symbols are stride bytes apart, returns how many there were, or -1 if there
+// are more than it can correct
+static int correct_codeword(std::uint8_t *symbols, std::size_t stride, const std::uint8_t *syndromes) {
+    // Berlekamp-Massey finds the error locator, whose roots are the inverses of where the errors are, lowest power first
+    std::uint8_t locator[fec_parity + 1] = {1}, previous[fec_parity + 1] = {1};
+    unsigned int errors = 0, shift = 1;
+    std::uint8_t last = 1;
+
+    for (unsigned int n = 0; n < fec_parity; n++) {
+        std::uint8_t delta = syndromes[n];
+        for (unsigned int i = 1; i <= errors; i++)
+            delta ^= mul_table[locator[i]][syndromes[n - i]];
+
+        if (!delta) {
+            shift++;
+            continue;
+        }
+
+        std::uint8_t before[fec_parity + 1];
+        std::copy_n(locator, fec_parity + 1, before);
+
+        auto scale = mul_table[delta][exp_table[255 - log_table[last]]];
+        for (unsigned int i = 0; i + shift <= fec_parity; i++)
+            locator[i + shift] ^= mul_table[scale][previous[i]];
+
+        if (2 * errors <= n) {
+            errors = n + 1 - errors;
+            std::copy_n(before, fec_parity + 1, previous);
+            last  = delta;
+            shift = 1;
+        }
+        else {
+            shift++;
+        }
+    }
+
+    if (errors > fec_parity / 2)
+        return -1;
+
+    // The error evaluator, syndromes times locator up to x^15
+    std::uint8_t evaluator[fec_parity] = {};
+    for (unsigned int i = 0; i < fec_parity; i++)
+        for (unsigned int k = 0; k <= i && k <= errors; k++)
+            evaluator[i] ^= mul_table[syndromes[i - k]][locator[k]];
+
+    // Chien search, symbol j is the coefficient of x^(254 - j)
+    unsigned int found = 0;
+
+    for (unsigned int j = 0; j < fec_total; j++) {
+        unsigned int power = fec_total - 1 - j;
+        std::uint8_t x_inv = exp_table[(255 - power) % 255];
+
+        std::uint8_t value = 0, x = 1;
+        for (unsigned int i = 0; i <= errors; i++) {
+            value ^= mul_table[locator[i]][x];
+            x = mul_table[x][x_inv];
+        }
+
+        if (value)
+            continue;
+
+        // Forney: with a^0 as the first root, the error is X * evaluator(1/X) / locator'(1/X), the derivative only has the odd powers
+        std::uint8_t omega = 0, derivative = 0;
+
+        x = 1;
+        for (unsigned int i = 0; i < fec_parity; i++) {
+            omega ^= mul_table[evaluator[i]][x];
+            x = mul_table[x][x_inv];
+        }
+
+        x = 1;
+        for (unsigned int i = 1; i <= errors; i += 2) {
+            derivative ^= mul_table[locator[i]][x];
+            x = mul_table[x][mul_table[x_inv][x_inv]];
+        }
+
+        if (!derivative)
+            return -1;
+
+        symbols[j * stride] ^= mul_table[exp_table[power]][mul_table[omega][exp_table[255 - log_table[derivative]]]];
+        found++;
+    }
+
+    // Fewer roots than errors means the locator is wrong, and so is the codeword
+    return found == errors ? int(found) : -1;
+}
+
+bool fec_decode(std::uint8_t *buffer, std::size_t size, std::size_t &corrected) {
+    build_tables();
+
+    auto n = (size + fec_data - 1) / fec_data;
+    auto slices = (n + fec_columns - 1) / fec_columns;
+
+    std::atomic<std::size_t> fixed{0};
+    std::atomic<bool> failed{false};
+
+    ThreadPool::shared().parallel_for(slices, [&](std::size_t slice) {
+        auto start = slice * fec_columns;
+        auto width = std::min(fec_columns, n - start);
+
+        // S_i = r(a^i) of every codeword, the sum of each row times a^i to the power of the row
+        std::vector<std::uint8_t> syndromes(fec_parity * width, 0);
+
+        for (unsigned int j = 0; j < fec_total; j++) {
+            auto *row = buffer + j * n + start;
+            auto power = fec_total - 1 - j;
+
+            for (unsigned int i = 0; i < fec_parity; i++)
+                gf_mul_add(exp_table[i * power % 255], row, &syndromes[i * width], width);
+        }
+
+        // Only the codewords with a syndrome that isn't zero have errors
+        for (std::size_t w = 0; w < width; w++) {
+            std::uint8_t codeword_syndromes[fec_parity];
+            std::uint8_t any = 0;
+
+            for (unsigned int i = 0; i < fec_parity; i++)
+                any |= codeword_syndromes[i] = syndromes[i * width + w];
+
+            if (!any)
+                continue;
+
+            int count = correct_codeword(buffer + start + w, n, codeword_syndromes);
+            if (count < 0)
+                failed = true;
+            else
+                fixed += count;
+        }
+    });
+
+    corrected = fixed;
+    return !failed;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Arithmetic in GF(256), with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+std::uint8_t gf_mul(std::uint8_t a, std::uint8_t b);
+std::uint8_t gf_inv(std::uint8_t a);
+
+// Multiplies size bytes of in by c, and adds (xors) the products into out
+void gf_mul_add(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size);
+
+// Multiplies size bytes of in by c into out, which can be in
+void gf_mul_region(std::uint8_t c, const std::uint8_t *in, std::uint8_t *out, std::size_t size);
+
+// Systematic Reed-Solomon erasure code: data shards followed by parity shards, all the same size, any data_shards of which
+// give back the others. The parity rows form a Cauchy matrix, so every choice of data_shards rows can be inverted.
+class ReedSolomon
+{
+public:
+    // At most 256 shards in all
+    ReedSolomon(unsigned int data_shards, unsigned int parity_shards);
+
+    // shards holds the data shards and then the parity shards, size bytes each, the parity shards are written
+    void encode(std::uint8_t *const *shards, std::size_t size) const;
+
+    // Fills in the data shards that aren't present, returns false if fewer than data_shards shards are.
+    // Missing parity shards are left alone, encode() gives them back once the data shards are all there.
+    bool reconstruct(std::uint8_t *const *shards, const bool *present, std::size_t size) const;
+
+private:
+    // outputs[i] = sum of coefficients[i * inputs.size() + j] * inputs[j], split into blocks that are done in parallel
+    static void apply(const std::vector<std::uint8_t> &coefficients, const std::vector<const std::uint8_t*> &inputs, const std::vector<std::uint8_t*> &outputs, std::size_t size);
+
+    unsigned int data_shards, parity_shards;
+    std::vector<std::uint8_t> matrix; // parity_shards rows of data_shards coefficients
+};
+
+// In-image error correction with Reed-Solomon (255, 239) codewords, each of which corrects up to 8 wrong bytes. The n codewords
+// are interleaved byte by byte: the data is left as it is, with byte k in codeword k % n, and is followed by 16 rows of n
+// parity bytes, so a run of wrong bytes is spread over many codewords.
+std::size_t fec_size(std::size_t size);
+
+// buffer holds fec_size(size) bytes, the first size of which are the data, the rest are filled in
+void fec_encode(std::uint8_t *buffer, std::size_t size);
+
+// Corrects the fec_size(size) bytes of buffer in place, returns false if a codeword has more errors than it can correct.
+// corrected is how many bytes were wrong.
+bool fec_decode(std::uint8_t *buffer, std::size_t size, std::size_t &corrected);
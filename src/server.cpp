@@ -0,0 +1,476 @@
+#include "server.hpp"
+
+#include <iostream>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <set>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "steganography.hpp"
+#include "cover_cache.hpp"
+#include "pipeline.hpp"
+#include "utils.hpp"
+
+enum RequestType {
+    EncodeRequest = 1,
+    DecodeRequest = 2,
+};
+
+// Statuses past the negated DecodeResults
+static const std::uint8_t status_failed      = 4;
+static const std::uint8_t status_bad_request = 5;
+
+// Type, flags, profile and a zero byte
+static const std::size_t request_header = 4;
+
+// Responses start with a uint32 length, tests lower the limit to reach it without gigabytes of output
+#ifndef SERVE_MAX_RESPONSE
+#define SERVE_MAX_RESPONSE UINT32_MAX
+#endif
+
+static const std::size_t max_response = SERVE_MAX_RESPONSE;
+
+static volatile std::sig_atomic_t stopping = 0;
+
+static void stop(int) {
+    stopping = 1;
+}
+
+// Reads exactly size bytes, fails if the connection closes first
+static bool read_all(int fd, void *data, std::size_t size) {
+    auto *p = static_cast<std::uint8_t*>(data);
+
+    while (size) {
+        auto count = ::recv(fd, p, size, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+
+        p    += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const void *data, std::size_t size) {
+    auto *p = static_cast<const std::uint8_t*>(data);
+
+    while (size) {
+        auto count = ::send(fd, p, size, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+
+        p    += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static std::uint32_t get_u32(const std::uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (std::uint32_t(p[3]) << 24);
+}
+
+static void put_u32(std::vector<std::uint8_t> &out, std::uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        out.push_back(value >> (i * 8));
+}
+
+// A request, read by its connection and run by a worker. The buffers are kept from one request of a connection to the next.
+struct Task {
+    std::vector<std::uint8_t> request; // Everything after the length
+    std::uint8_t type, flags, profile;
+    std::string password, name, channels;
+    const std::uint8_t *image, *payload;
+    std::size_t image_size, payload_size;
+
+    std::vector<std::uint8_t> output;  // The encoded image or the decoded payload
+    std::uint8_t status;
+    std::string message;
+
+    bool done;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// Picks the request apart, leaving why it can't be in the task's message
+static bool parse_request(Task &task) {
+    auto &request = task.request;
+
+    if (request.size() < request_header) {
+        task.message = "Request is too short";
+        return false;
+    }
+
+    task.type    = request[0];
+    task.flags   = request[1];
+    task.profile = request[2];
+
+    std::size_t pos = request_header;
+    auto field = [&](const std::uint8_t *&data, std::size_t &size) {
+        if (request.size() - pos < 4 || request.size() - pos - 4 < get_u32(&request[pos]))
+            return false;
+
+        size = get_u32(&request[pos]);
+        data = &request[pos + 4];
+        pos += 4 + size;
+
+        return true;
+    };
+
+    const std::uint8_t *password, *name = nullptr, *channels = nullptr;
+    std::size_t password_size, name_size = 0, channels_size = 0;
+    task.payload      = nullptr;
+    task.payload_size = 0;
+
+    bool encode = task.type == EncodeRequest;
+
+    if (!encode && task.type != DecodeRequest) {
+        task.message = "Unknown request type " + std::to_string(task.type);
+        return false;
+    }
+
+    if (request[3] || task.flags & ~1u || (encode ? task.profile > 2 : task.flags || task.profile)) {
+        task.message = "Unknown flags or PNG profile";
+        return false;
+    }
+
+    if (!field(password, password_size) || !field(task.image, task.image_size) ||
+        (encode && (!field(name, name_size) || !field(channels, channels_size) || !field(task.payload, task.payload_size))) || pos != request.size()) {
+        task.message = "Fields don't add up to the request's length";
+        return false;
+    }
+
+    task.password.assign(reinterpret_cast<const char*>(password), password_size);
+    task.name.assign(reinterpret_cast<const char*>(name), name_size);
+    task.channels.assign(reinterpret_cast<const char*>(channels), channels_size);
+
+    return true;
+}
+
+static void run_task(Task &task, CoverCache *cache) {
+    std::ostringstream err;
+    auto password = hash_password(task.password);
+
+    if (task.type == EncodeRequest) {
+        EncodeOptions options;
+        options.profile  = static_cast<Image::PngProfile>(task.profile);
+        options.channels = task.channels;
+        options.fec      = task.flags & 1;
+        options.cache    = cache;
+
+        int result = encode_memory(task.image, task.image_size, task.payload, task.payload_size, task.name, password, options, task.output, err);
+        task.status = result < 0 ? status_failed : 0;
+    }
+    else {
+        int result = decode_memory(task.image, task.image_size, password, task.output, task.name, err);
+        task.status = -result;
+    }
+
+    // Just the first error, without its prefix
+    task.message = err.str();
+    task.message = task.message.substr(0, task.message.find('\n'));
+    if (task.message.rfind("ERROR: ", 0) == 0)
+        task.message.erase(0, 7);
+}
+
+// Bytes of the task's response after its length
+static std::size_t response_length(const Task &task) {
+    bool done   = task.status == 0;
+    bool decode = done && task.type == DecodeRequest;
+
+    return 4 + 4 + task.message.size() + (done ? 4 + task.output.size() : 0) + (decode ? 4 + task.name.size() : 0);
+}
+
+// Sends the task's response, the output goes straight from its buffer
+static bool respond(int fd, const Task &task) {
+    bool done   = task.status == 0;
+    bool decode = done && task.type == DecodeRequest;
+    auto output = done ? task.output.size() : 0;
+
+    std::vector<std::uint8_t> head;
+    head.reserve(64 + task.message.size() + task.name.size());
+
+    auto length = response_length(task);
+    if (length > max_response)
+        return false;
+
+    put_u32(head, length);
+    head.push_back(task.status);
+    head.insert(head.end(), 3, 0);
+
+    put_u32(head, task.message.size());
+    head.insert(head.end(), task.message.begin(), task.message.end());
+
+    if (decode) {
+        put_u32(head, task.name.size());
+        head.insert(head.end(), task.name.begin(), task.name.end());
+    }
+
+    if (done)
+        put_u32(head, output);
+
+    return write_all(fd, head.data(), head.size()) && write_all(fd, task.output.data(), output);
+}
+
+// The requests of the connections, queued up for the workers
+class Server
+{
+public:
+    Server(unsigned int workers, std::size_t queue, std::size_t max_request, std::size_t max_connections, std::size_t cache_size)
+        : tasks(queue), max_request(max_request), max_connections(max_connections), cache(cache_size ? std::make_unique<CoverCache>(cache_size) : nullptr), requests(0) {
+        for (unsigned int i = 0; i < workers; i++) {
+            threads.emplace_back([this]() {
+                Task *task;
+                while (tasks.pop(task)) {
+                    run_task(*task, cache.get());
+
+                    std::lock_guard<std::mutex> lock(task->mutex);
+                    task->done = true;
+                    task->cv.notify_one();
+                }
+            });
+        }
+    }
+
+    // Reads, queues and answers the requests of a connection on a thread of its own. Each connection holds a thread and up
+    // to max_request bytes, so past max_connections they are answered with a bad request and closed straight away.
+    void open(int fd) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            full = connections.size() >= max_connections;
+            if (!full)
+                connections.insert(fd);
+        }
+
+        if (full) {
+            Task task;
+            task.status  = status_bad_request;
+            task.type    = 0;
+            task.message = "Too many connections, the limit is " + std::to_string(max_connections);
+            report(task, 0);
+            respond(fd, task);
+            ::close(fd);
+            return;
+        }
+
+        std::thread([this, fd]() {
+            serve_connection(fd);
+            ::close(fd);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.erase(fd);
+            closed.notify_all();
+        }).detach();
+    }
+
+    // Lets the requests already read finish and be answered, then stops the connections and the workers. Only reading is
+    // shut down, so that the responses still being worked out can be written.
+    std::size_t stop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto fd : connections)
+            ::shutdown(fd, SHUT_RD);
+
+        closed.wait(lock, [this]() { return connections.empty(); });
+        lock.unlock();
+
+        tasks.close();
+        for (auto &thread : threads)
+            thread.join();
+
+        return requests;
+    }
+
+private:
+    void serve_connection(int fd) {
+        using clock = std::chrono::steady_clock;
+
+        Task task;
+        std::uint8_t prefix[4];
+
+        while (read_all(fd, prefix, sizeof(prefix))) {
+            auto length = get_u32(prefix);
+            bool valid  = length <= max_request;
+
+            if (!valid) {
+                task.message = "Request of " + data_size(length) + " is over the limit of " + data_size(max_request);
+            }
+            else {
+                task.request.resize(length);
+                if (!read_all(fd, task.request.data(), length))
+                    break;
+
+                valid = parse_request(task);
+            }
+
+            if (!valid) {
+                task.status = status_bad_request;
+                task.type   = 0;
+                report(task, 0);
+                respond(fd, task);
+                break;
+            }
+
+            auto start = clock::now();
+
+            // Blocks while the queue is full, which leaves the rest of the connection unread
+            task.done = false;
+            tasks.push(&task);
+
+            {
+                std::unique_lock<std::mutex> lock(task.mutex);
+                task.cv.wait(lock, [&task]() { return task.done; });
+            }
+
+            // A result too big for the response's length field fails instead of dropping the connection
+            if (response_length(task) > max_response) {
+                task.message = "Response of " + data_size(response_length(task)) + " is over the limit of " + data_size(max_response);
+                task.status  = status_failed;
+            }
+
+            report(task, std::chrono::duration<double>(clock::now() - start).count());
+
+            if (!respond(fd, task))
+                break;
+        }
+    }
+
+    void report(const Task &task, double seconds) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto number = ++requests;
+
+        const char *type = task.type == EncodeRequest ? "encode" : task.type == DecodeRequest ? "decode" : "request";
+
+        if (task.status) {
+            std::cerr << "ERROR: [" << number << "] " << type << ": " << task.message << std::endl;
+            return;
+        }
+
+        std::cout << "* [" << number << "] " << type << ": " << data_size(task.image_size) << " image, "
+                  << data_size(task.type == EncodeRequest ? task.payload_size : task.output.size()) << " embed in "
+                  << std::fixed << std::setprecision(1) << seconds * 1000 << " ms" << std::endl;
+    }
+
+    BoundedQueue<Task*> tasks;
+    std::vector<std::thread> threads;
+    std::size_t max_request, max_connections;
+    std::unique_ptr<CoverCache> cache;
+
+    std::mutex mutex;
+    std::condition_variable closed;
+    std::set<int> connections;
+    std::size_t requests;
+};
+
+int serve(const std::string &path, unsigned int workers, std::size_t queue, std::size_t max_request, std::size_t max_connections, std::size_t cache) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "ERROR: Socket path '" << path << "' has to be 1 to " << (sizeof(address.sun_path) - 1) << " characters" << std::endl;
+        return -1;
+    }
+
+    std::memcpy(address.sun_path, path.data(), path.size());
+
+    // A socket left behind by a server that is gone is replaced, one that still answers isn't
+    struct stat info;
+    if (!lstat(path.c_str(), &info)) {
+        if (!S_ISSOCK(info.st_mode)) {
+            std::cerr << "ERROR: '" << path << "' already exists and isn't a socket" << std::endl;
+            return -1;
+        }
+
+        int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 && !::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        if (probe >= 0)
+            ::close(probe);
+
+        if (live) {
+            std::cerr << "ERROR: A server is already listening on '" << path << "'" << std::endl;
+            return -1;
+        }
+
+        ::unlink(path.c_str());
+    }
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "ERROR: Unable to create a socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // Requests carry passwords, so only the user running the server gets to connect
+    auto mask  = ::umask(0177);
+    bool bound = !::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    ::umask(mask);
+
+    if (!bound || ::listen(listener, SOMAXCONN)) {
+        std::cerr << "ERROR: Unable to listen on '" << path << "': " << std::strerror(errno) << std::endl;
+        ::close(listener);
+        return -1;
+    }
+
+    // No SA_RESTART, so that poll() returns as soon as a signal comes in. A client that goes away mid-response is only a
+    // failed send.
+    struct sigaction action = {};
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // The first request shouldn't be the one to fill the tables in
+    warm_up();
+
+    Server server(workers, queue, max_request, max_connections, cache);
+
+    std::cout << "* Serving on " << path << " with " << workers << (workers == 1 ? " worker, " : " workers, ")
+              << queue << " requests can wait for one, up to " << max_connections << " connections" << std::endl;
+
+    while (!stopping) {
+        pollfd ready = {listener, POLLIN, 0};
+        if (::poll(&ready, 1, 500) <= 0)
+            continue;
+
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd >= 0)
+            server.open(fd);
+    }
+
+    ::close(listener);
+    ::unlink(path.c_str());
+
+    auto requests = server.stop();
+    std::cout << "* Stopped after " << requests << (requests == 1 ? " request" : " requests") << std::endl;
+
+    return 0;
+}
+
+#else
+
+int serve(const std::string &path, unsigned int workers, std::size_t queue, std::size_t max_request, std::size_t max_connections, std::size_t cache) {
+    std::cerr << "ERROR: serve needs Unix domain sockets, which this platform doesn't have" << std::endl;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Serves encodes and decodes over a Unix domain socket until SIGINT or SIGTERM. Every number is little-endian, a field is a
+// uint32 length followed by that many bytes. A connection can send any number of requests, each is answered in turn:
+//
+//   request:  uint32 length of the rest, uint8 type (1 encode, 2 decode), uint8 flags (bit 0 adds error correction),
+//             uint8 PNG profile (0 fast, 1 balanced, 2 small), uint8 zero, then the fields password and image,
+//             and for an encode name, channels ("all" for every one) and payload
+//   response: uint32 length of the rest, uint8 status (0 done, 1 wrong password or no embed, 2 corrupt, 3 unreadable image,
+//             4 failed, 5 bad request), three zero bytes, then the field message (empty when done), and when done the field
+//             image for an encode, or the fields name and payload for a decode
+//
+// Connections are read and written on their own threads, and the requests run on worker threads. At most queue requests
+// wait for a worker, connections with another one stop being read until there is room, so clients feel the backpressure.
+// A bad request is answered and its connection closed, requests over max_request bytes aren't read at all. Connections past
+// max_connections are answered with a bad request and closed, so at most that many requests are held in memory at once.
+// Up to cache bytes of decoded covers are kept, so that encodes into a cover sent before skip decoding it.
+int serve(const std::string &path, unsigned int workers, std::size_t queue, std::size_t max_request, std::size_t max_connections, std::size_t cache);
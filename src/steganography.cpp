@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <streambuf>
+
+#include "steganography.hpp"
+#include "cover_cache.hpp"
+#include "aes.hpp"
+#include "sha256.hpp"
+#include "crc32.hpp"
+#include "random.hpp"
+#include "reed_solomon.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+#define VERSION 1
+#define KEY_ROUNDS 20000
+
+const char *channel_names[5] = {"", "y", "ya", "rgb", "rgba"};
+
+const char *level_to_str[3] = {
+    "Low (Default)",
+    "Medium",
+    "High"
+};
+
+// Turns channel letters into a channel mask for an image with that many channels, 0 for all of them and -1 if a letter isn't
+// there or there are none
+int parse_channels(const std::string &str, unsigned int channels) {
+    if (str == "all")
+        return 0;
+
+    if (str.empty())
+        return -1;
+
+    int mask = 0;
+    for (auto c : str) {
+        auto found = std::string(channel_names[channels]).find(c);
+        if (found == std::string::npos)
+            return -1;
+
+        mask |= 1 << found;
+    }
+
+    // Every channel is the same as the default
+    return mask == (1 << channels) - 1 ? 0 : mask;
+}
+
+// Turns a channel mask back into letters
+std::string channels_to_str(unsigned int mask, unsigned int channels) {
+    if (!mask)
+        return "all";
+
+    std::string str;
+    for (unsigned int c = 0; c < channels; c++)
+        if (mask & (1u << c))
+            str += channel_names[channels][c];
+
+    return str;
+}
+
+void warm_up() {
+    std::uint8_t key[32] = {}, iv[16] = {};
+    AES aes(key, iv);
+
+    std::vector<std::uint8_t> buffer(fec_size(16));
+    fec_encode(buffer.data(), 16);
+
+    ThreadPool::shared();
+}
+
+std::array<std::uint8_t, 32> hash_password(const std::string &password) {
+    std::array<std::uint8_t, 32> hash;
+    SHA256 sha;
+    sha.update(password.data(), password.size());
+    sha.finish();
+    sha.get_hash(hash.data());
+
+    return hash;
+}
+
+// Runs PBKDF2 on the calling thread
+std::array<std::uint8_t, 32> generate_key(const std::array<std::uint8_t, 32> &password, const std::uint8_t *salt) {
+    std::array<std::uint8_t, 32> key;
+    pbkdf2_hmac_sha256(password.data(), password.size(), salt, 16, key.data(), key.size(), KEY_ROUNDS);
+    return key;
+}
+
+// Runs PBKDF2 on a worker thread, so that it overlaps with loading the image and the embed
+std::future<std::array<std::uint8_t, 32>> derive_key(const std::array<std::uint8_t, 32> &password, const std::uint8_t *salt) {
+    std::array<std::uint8_t, 16> salt_copy;
+    std::copy_n(salt, salt_copy.size(), salt_copy.begin());
+
+    return std::async(std::launch::async, [password, salt_copy]() {
+        return generate_key(password, salt_copy.data());
+    });
+}
+
+// Bytes of the image that a padded embed of size bytes takes up, before encoding
+std::size_t stored_size(std::size_t size, bool fec) {
+    return fec ? fec_size(size) : size;
+}
+
+// The most that fits in a padded embed that takes up at most max_size bytes
+std::size_t max_unpadded(std::size_t max_size, bool fec) {
+    if (fec)
+        max_size = max_size / fec_size(1) * (fec_size(1) - 16);
+
+    return max_size < 16 ? 0 : max_size / 16 * 16 - 1;
+}
+
+int generate_salt(EncodeJob &job) {
+    Random random;
+    if (!random.get(job.salt, sizeof job.salt) || !random.get(job.iv, sizeof job.iv)) {
+        job.err << "ERROR: Unable to generate random number" << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Works out how much the loaded cover can hold in the job's channels
+int fit_cover(EncodeJob &job) {
+    auto &log = job.log;
+    auto &err = job.err;
+    auto &image = job.image;
+
+    // Find which channels to embed into
+    int mask = parse_channels(job.channels, image.c());
+    if (mask < 0 && job.channels.empty()) {
+        err << "ERROR: No channels given, use 'all' for every channel" << std::endl;
+        return -1;
+    }
+
+    if (mask < 0) {
+        err << "ERROR: Channels '" << job.channels << "' don't match the image's channels (" << channel_names[image.c()] << ")" << std::endl;
+        return -1;
+    }
+
+    log << "* Image size: " << image.w() << "x" << image.h() << " pixels, " << image.c() << " channels" << (image.d() == 16 ? " of 16 bits" : "") << std::endl;
+    log << "* Encoding level: " << level_to_str[static_cast<int>(job.level)] << std::endl;
+    log << "* Embedding into channels: " << channels_to_str(mask, image.c()) << std::endl;
+
+    // The header takes up the first pixels in every channel, the embed goes in the picked channels of the pixels after them
+    auto pixels      = std::size_t(image.w()) * image.h();
+    auto pixel_bytes = image.size() / pixels;
+    auto header_end  = (header_region + pixel_bytes - 1) / pixel_bytes * (image.size(mask) / pixels);
+
+    if (image.size(mask) < header_end) {
+        err << "ERROR: Image is too small to hold an embed" << std::endl;
+        return -1;
+    }
+
+    // Find the maximum possible size for the file
+    job.mask       = mask;
+    job.header_end = header_end;
+    job.max_size   = (image.size(mask) - header_end) / Image::encoded_size(1, job.level);
+
+    log << "* Max embed size: " << data_size(job.max_size) << std::endl;
+
+    return 0;
+}
+
+// Pads the embed in the job's data, picks where it goes and fills in the header
+int pack_embed(EncodeJob &job) {
+    auto &log = job.log;
+    auto &err = job.err;
+
+    // Find the data and padded-data size
+    std::size_t size = job.data.size();
+    std::size_t padded_size = size + 1; // At least one byte of padding
+    
+    if (padded_size % 16)
+        padded_size = (size / 16 + 1) * 16;
+
+    auto stored = stored_size(padded_size, job.fec);
+
+    log << "* Embed size: " << data_size(size) << std::endl;
+    log << "* Encrypted embed size: " << data_size(padded_size) << std::endl;
+    if (job.fec)
+        log << "* Size with error correction: " << data_size(stored) << std::endl;
+
+    // Make sure that it isn't too big
+    if (stored > job.max_size) {
+        err << "ERROR: Data-File too big, maximum possible size: " << (job.max_size / 1024) << " KiB" << std::endl;
+        return -1;
+    }
+
+    // Pad the data (#PKCS7)
+    std::uint8_t left = padded_size - size;
+    job.data.resize(padded_size, left);
+
+    // Pick a random offset inside the image to store the data
+    Random random;
+    std::uint32_t offset;
+    if (!random.get(&offset, sizeof(offset)))
+    {
+        err << "Unable to generate random number" << std::endl;
+        return -1;
+    }
+
+    offset = job.header_end + offset % (Image::encoded_size(job.max_size - stored, job.level) + 1);
+
+    // Calculate a hash of the data
+    CRC32 crc;
+    crc.update(job.data.data(), size);
+
+    log << "* Generated CRC32 checksum" << std::endl;
+
+    // Copy the header information, not sharded unless the caller says otherwise
+    auto &header = job.header;
+    header.sig[0] = 'H'; header.sig[1] = 'I'; header.sig[2] = 'D'; header.sig[3] = 'E';
+    header.version = VERSION;
+    header.level  = static_cast<std::uint8_t>(job.level);
+    header.flags  = job.mask | (job.fec ? fec_flag : 0);
+    header.offset = offset;
+    header.size   = padded_size;
+    header.hash   = crc.get_hash();
+    header.set    = 0;
+    header.shard  = 0;
+    header.shards = 0;
+    header.parity = 0;
+    header.total  = 0;
+
+    // Copy the file name to the header
+    auto &name = job.name;
+    if (name.size() > sizeof(header.name)) {
+        err << "ERROR: File name '" << name << "' is over 32 characters" << std::endl;
+        return -1;
+    }
+    std::copy_n(name.data(), name.size(), header.name);
+    std::fill_n(&header.name[name.size()], sizeof(header.name) - name.size(), 0x00);
+    std::fill_n(header.reserved, sizeof(header.reserved), 0x00);
+
+    job.size = size;
+
+    return 0;
+}
+
+// Encrypts the header and the embed with the job's key, and embeds them in the image
+int embed_payload(EncodeJob &job) {
+    job.log << "* Generated encryption key with PBKDF2-HMAC-SHA-256 (" << KEY_ROUNDS << " rounds)" << std::endl;
+
+    // Encrypt a copy of the header, encryption scrambles its input and the offset and flags are still needed
+    AES aes(job.key.data(), job.iv);
+    std::uint8_t encrypted_header[sizeof(Header)];
+    std::memcpy(encrypted_header, &job.header, sizeof(Header));
+    aes.cbc_encrypt(encrypted_header, sizeof(Header), encrypted_header);
+
+    // Encrypt the data
+    aes.cbc_encrypt(job.data.data(), job.data.size(), job.data.data());
+
+    job.log << "* Encrypted embed with AES-256-CBC" << std::endl;
+
+    // Error correction goes over the encrypted embed, so that it can be checked before decrypting
+    if (job.fec) {
+        auto size = job.data.size();
+        job.data.resize(fec_size(size));
+        fec_encode(job.data.data(), size);
+
+        job.log << "* Added Reed-Solomon error correction" << std::endl;
+    }
+
+    // Encode the data, the salt, IV and header are always at the Low level so that decoding can find them before it knows the level
+    auto &image = job.image;
+    image.encode(job.salt, 16, Image::EncodingLevel::Low);
+    image.encode(job.iv, 16, Image::EncodingLevel::Low, Image::encoded_size(16, Image::EncodingLevel::Low));
+    image.encode(encrypted_header, sizeof(Header), Image::EncodingLevel::Low, Image::encoded_size(32, Image::EncodingLevel::Low));
+    image.encode(job.data.data(), job.data.size(), job.level, job.header.offset, job.mask);
+
+    job.log << "* Embedded " << (job.name.empty() ? "embed" : job.name) << " into image" << std::endl;
+
+    return 0;
+}
+
+// Decrypts and checks the header, iv is left as the IV that the embed was encrypted with.
+// Only the rows up to the end of the header have to be decoded, with read_ahead more rows are decoded while the key is derived.
+int read_header(Image &image, const std::array<std::uint8_t, 32> &password, Header &header, std::uint8_t key[32], std::uint8_t iv[16], bool read_ahead, std::ostream &log, std::ostream &err) {
+    log << "* Image size: " << image.w() << "x" << image.h() << " pixels, " << image.c() << " channels" << (image.d() == 16 ? " of 16 bits" : "") << std::endl;
+
+    if (!image.require(header_region)) {
+        err << "ERROR: Image is too small to hold an embed" << std::endl;
+        return WrongPassword;
+    }
+
+    // Extract the Salt and IV
+    auto salt = image.decode(16, Image::EncodingLevel::Low);
+    auto header_iv = image.decode(16, Image::EncodingLevel::Low, Image::encoded_size(16, Image::EncodingLevel::Low));
+
+    // Generate the key
+    auto pending_key = derive_key(password, salt.get());
+
+    // Where the embed is won't be known until the header is decrypted, so keep decoding rows in the meantime
+    if (read_ahead) {
+        auto total = image.size();
+        auto limit = header_region;
+
+        while (limit < total && pending_key.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            limit = std::min(limit + total / image.h() * 16, total);
+            if (!image.require(limit))
+                break;
+        }
+    }
+
+    auto derived = pending_key.get();
+    std::copy(derived.begin(), derived.end(), key);
+
+    log << "* Generated decryption key with PBKDF2-HMAC-SHA-256 (" << KEY_ROUNDS << " rounds)" << std::endl;
+
+    // Extract the header
+    auto encrypted_header = image.decode(sizeof(Header), Image::EncodingLevel::Low, Image::encoded_size(32, Image::EncodingLevel::Low));
+
+    // Decrypt the header
+    AES aes(key, header_iv.get());
+    aes.cbc_decrypt(encrypted_header.get(), sizeof(Header), &header);
+
+    // The embed was encrypted straight after the header, so its chain carries on from the last header block
+    std::copy_n(encrypted_header.get() + sizeof(Header) - 16, 16, iv);
+
+    // Make sure that the file-signature match, i.e. successful decryption
+    if (header.sig[0] != 'H' || header.sig[1] != 'I' || header.sig[2] != 'D' || header.sig[3] != 'E') {
+        err << "ERROR: Decryption failed, wrong password or no embed" << std::endl;
+        return WrongPassword;
+    }
+
+    // From here on the key is right, so anything that doesn't add up is corruption
+
+    // Make sure that the version is correct
+    if (header.version != VERSION) {
+        err << "ERROR: Unsupported file-version " << header.version << std::endl;
+        return Corrupt;
+    }
+
+    // Make sure that the reserved data is all zeros
+    for (auto r : header.reserved) {
+        if (r) {
+            err << "ERROR: Reserved header bytes are set, corrupt file" << std::endl;
+            return Corrupt;
+        }
+    }
+
+    if (header.level > static_cast<std::uint8_t>(Image::EncodingLevel::High)) {
+        err << "ERROR: Unsupported encoding level " << int(header.level) << std::endl;
+        return Corrupt;
+    }
+
+    // The low 4 bits of the flags are the channel mask
+    if ((header.flags & 0xf) >> image.c()) {
+        err << "ERROR: Embed uses channels the image doesn't have, corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    if (header.flags & ~(fec_flag | 0xf)) {
+        err << "ERROR: Unknown header flags " << int(header.flags) << ", corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    // An embed that isn't sharded has no set, a shard has to be one of its set, which has at least one data shard
+    if (header.shards ? header.shard >= header.shards || header.parity >= header.shards : header.shard || header.set || header.parity || header.total) {
+        err << "ERROR: Invalid shard " << int(header.shard) << " of " << int(header.shards) << ", corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    // The embed is whole AES blocks, with at least one byte of padding
+    if (!header.size || header.size % 16) {
+        err << "ERROR: Invalid embed size " << header.size << ", corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    log << "* Successfully decrypted header" << std::endl;
+    log << "* File signatures match" << std::endl;
+
+    return Decoded;
+}
+
+// Copies the name, accounting for the fact that there might be no null-terminator
+std::string header_name(const Header &header) {
+    if (header.name[sizeof(header.name)-1])
+        return std::string(reinterpret_cast<const char*>(header.name), sizeof(header.name));
+
+    return std::string(reinterpret_cast<const char*>(header.name));
+}
+
+// Decodes, decrypts and checks the embed, leaving it in data without its padding
+int extract(Image &image, const std::array<std::uint8_t, 32> &password, Header &header, std::vector<std::uint8_t> &data, std::ostream &log, std::ostream &err) {
+    std::uint8_t key[32], iv[16];
+
+    int result = read_header(image, password, header, key, iv, true, log, err);
+    if (result < 0)
+        return result;
+
+    auto level  = static_cast<Image::EncodingLevel>(header.level);
+    auto mask   = header.flags & 0xf;
+    bool fec    = header.flags & fec_flag;
+    auto stored = stored_size(header.size, fec);
+
+    log << "* Detected embed " << header_name(header) << std::endl;
+    log << "* Encoding level: " << level_to_str[header.level] << std::endl;
+
+    // Only decode the rows up to the end of the embed, keeping just the bits of them the level uses
+    image.keep_level(level);
+
+    if (!image.require(image.extent(std::size_t(header.offset) + Image::encoded_size(stored, level), mask))) {
+        err << "ERROR: Unable to read the embed, corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    // Decode the data
+    auto encrypted_data = image.decode(stored, level, header.offset, mask);
+
+    log << "* Encrypted embed size: " << data_size(header.size) << std::endl;
+
+    // Put right any bytes that changed since the embed was written
+    if (fec) {
+        std::size_t corrected;
+        if (!fec_decode(encrypted_data.get(), header.size, corrected)) {
+            err << "ERROR: Too many errors to correct, corrupt file" << std::endl;
+            return Corrupt;
+        }
+
+        log << "* Error correction: " << corrected << (corrected == 1 ? " byte" : " bytes") << " corrected" << std::endl;
+    }
+
+    // Decrypt the data
+    AES aes(key, iv);
+    data.resize(header.size);
+    aes.cbc_decrypt(encrypted_data.get(), header.size, data.data());
+
+    log << "* Successfully decrypted the embed" << std::endl;
+
+    // Find how much padding to strip
+    std::uint8_t left = data[header.size - 1];
+    if (!left || left > 16) {
+        err << "ERROR: Invalid padding, corrupt file" << std::endl;
+        return Corrupt;
+    }
+
+    data.resize(header.size - left);
+
+    log << "* Decrypted embed size: " << data_size(data.size()) << std::endl;
+
+    // Calculate the CRC32 hash
+    CRC32 crc;
+    crc.update(data.data(), data.size());
+
+    // Make sure that the data matches
+    if (crc.get_hash() != header.hash) {
+        err << "ERROR: File is corrupted!" << std::endl;
+        return Corrupt;
+    }
+
+    log << "* CRC32 checksum matches" << std::endl;
+
+    return Decoded;
+}
+
+// Appends whatever is written to it to a vector, so that an image can be saved to memory without going through a string
+class VectorBuf : public std::streambuf
+{
+public:
+    explicit VectorBuf(std::vector<std::uint8_t> &out) : out(out) {
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof())
+            out.push_back(static_cast<std::uint8_t>(c));
+
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize count) override {
+        out.insert(out.end(), s, s + count);
+        return count;
+    }
+
+private:
+    std::vector<std::uint8_t> &out;
+};
+
+int encode_memory(const std::uint8_t *cover, std::size_t cover_size, const std::uint8_t *payload, std::size_t payload_size, const std::string &name,
+                  const std::array<std::uint8_t, 32> &password, const EncodeOptions &options, std::vector<std::uint8_t> &out, std::ostream &err) {
+    // Progress lines go nowhere, a stream without a buffer drops them
+    std::ostream quiet(nullptr);
+
+    EncodeJob job(options.level, options.channels, options.fec, quiet, err);
+    job.name = name;
+
+    if (generate_salt(job) < 0)
+        return -1;
+
+    auto pending_key = derive_key(password, job.salt);
+
+    if (options.cache ? !options.cache->load(cover, cover_size, job.image) : !job.image.load(cover, cover_size)) {
+        err << "ERROR: Failed to load image" << std::endl;
+        return -1;
+    }
+
+    if (fit_cover(job) < 0)
+        return -1;
+
+    auto limit = max_unpadded(job.max_size, job.fec);
+    if (payload_size > limit) {
+        err << "ERROR: Data-File too big, maximum possible size: " << (limit / 1024) << " KiB" << std::endl;
+        return -1;
+    }
+
+    // Leave room for the padding
+    job.data.reserve(payload_size + 16);
+    job.data.assign(payload, payload + payload_size);
+
+    if (pack_embed(job) < 0)
+        return -1;
+
+    job.key = pending_key.get();
+
+    if (embed_payload(job) < 0)
+        return -1;
+
+    out.clear();
+    VectorBuf buffer(out);
+    std::ostream stream(&buffer);
+
+    if (!job.image.save(stream, options.profile)) {
+        err << "ERROR: Unable to save image" << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+int decode_memory(const std::uint8_t *data, std::size_t size, const std::array<std::uint8_t, 32> &password,
+                  std::vector<std::uint8_t> &payload, std::string &name, std::ostream &err) {
+    std::ostream quiet(nullptr);
+
+    Image image;
+    if (!image.load(data, size)) {
+        err << "ERROR: Failed to load image" << std::endl;
+        return Unreadable;
+    }
+
+    Header header;
+    int result = extract(image, password, header, payload, quiet, err);
+    if (result < 0)
+        return result;
+
+    // One shard is only part of the embed
+    if (header.shards) {
+        err << "ERROR: Image holds shard " << (header.shard + 1) << " of " << int(header.shards) << " of an embed, not a whole one" << std::endl;
+        payload.clear();
+        return Corrupt;
+    }
+
+    name = header_name(header);
+
+    return Decoded;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <future>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+
+class CoverCache;
+
+// 64 bytes
+struct Header {
+    // std::uint8_t salt[16];
+    // std::uint8_t iv  [16];
+    std::uint8_t  sig[4];   // File Signature (HIDE)
+    std::uint16_t version;  // Format Version
+    std::uint8_t  level;    // Encoding level
+    std::uint8_t  flags;    // Flags
+    std::uint32_t offset;   // Offset to data
+    std::uint32_t size;     // Size of data
+    std::uint32_t hash;     // CRC32 hash of data
+    std::uint8_t  name[32]; // File name, unused space filled with zeros
+    std::uint32_t set;      // Random number shared by the shards of an embed
+    std::uint8_t  shard;    // Which shard of the embed this is, from 0
+    std::uint8_t  shards;   // How many shards the embed is split into, 0 if it isn't
+    std::uint8_t  parity;   // How many of the shards are Reed-Solomon parity, after the data shards
+    std::uint8_t  reserved[1]; // Must be filled with zeros
+    std::uint32_t total;    // Size of the whole embed, for a shard
+};
+static_assert(sizeof(Header) == 64);
+
+// Header flag for an embed with in-image error correction, the bits below it are the channel mask
+static const std::uint8_t fec_flag = 0x10;
+
+// Pixel bytes holding the salt, IV and header, all at the Low level
+static const std::size_t header_region = Image::encoded_size(32 + sizeof(Header), Image::EncodingLevel::Low);
+
+// The letters of each channel, for each channel count
+extern const char *channel_names[5];
+extern const char *level_to_str[3];
+
+// Turns channel letters into a channel mask for an image with that many channels, 0 for all of them and -1 if a letter isn't
+// there or there are none
+int parse_channels(const std::string &str, unsigned int channels);
+
+// Turns a channel mask back into letters
+std::string channels_to_str(unsigned int mask, unsigned int channels);
+
+// Fills the AES and Reed-Solomon tables and starts the shared thread pool, which the first encode or decode would otherwise
+// do, so that a long-running process doesn't make its first request wait for them
+void warm_up();
+
+// The password hash that keys are derived from
+std::array<std::uint8_t, 32> hash_password(const std::string &password);
+
+// Runs PBKDF2 on the calling thread
+std::array<std::uint8_t, 32> generate_key(const std::array<std::uint8_t, 32> &password, const std::uint8_t *salt);
+
+// Runs PBKDF2 on a worker thread, so that it overlaps with loading the image and the embed
+std::future<std::array<std::uint8_t, 32>> derive_key(const std::array<std::uint8_t, 32> &password, const std::uint8_t *salt);
+
+// Bytes of the image that a padded embed of size bytes takes up, before encoding
+std::size_t stored_size(std::size_t size, bool fec);
+
+// The most that fits in a padded embed that takes up at most max_size bytes
+std::size_t max_unpadded(std::size_t max_size, bool fec);
+
+// An encode, split into steps that can run apart: generate_salt(), then loading the image and fit_cover(), reading the embed
+// into data and pack_embed(), then the key, then embed_payload() and finally saving the image. Each step returns -1 on failure.
+struct EncodeJob {
+    EncodeJob(Image::EncodingLevel level, const std::string &channels, bool fec, std::ostream &log, std::ostream &err)
+        : level(level), channels(channels), fec(fec), log(log), err(err) {
+    }
+
+    Image::EncodingLevel level;
+    std::string channels;
+    bool fec;                       // Add in-image error correction to the embed
+    std::string name;               // Stored in the header, at most 32 bytes
+    std::ostream &log, &err;
+
+    std::uint8_t salt[16], iv[16];
+    std::array<std::uint8_t, 32> key;
+
+    Image image;
+    unsigned int mask;
+    std::size_t header_end;         // Pixel bytes before the embed can start
+    std::size_t max_size;           // Most padded embed bytes the cover can hold
+    std::vector<std::uint8_t> data; // Embed, padded by pack_embed(), encrypted in place and followed by its error correction
+    std::size_t size;               // Size of the embed before padding
+    Header header;
+};
+
+int generate_salt(EncodeJob &job);
+
+// Works out how much the loaded cover can hold in the job's channels
+int fit_cover(EncodeJob &job);
+
+// Pads the embed in the job's data, picks where it goes and fills in the header
+int pack_embed(EncodeJob &job);
+
+// Encrypts the header and the embed with the job's key, and embeds them in the image
+int embed_payload(EncodeJob &job);
+
+// Why a decode failed, batch-decode counts them apart
+enum DecodeResult {
+    Decoded       = 0,
+    WrongPassword = -1, // The header didn't decrypt, which is also what an image without an embed looks like
+    Corrupt       = -2, // The header decrypted, but the embed doesn't check out
+    Unreadable    = -3, // The image couldn't be loaded
+    WriteFailed   = -4, // The embed couldn't be written out
+};
+
+// Decrypts and checks the header, iv is left as the IV that the embed was encrypted with.
+// Only the rows up to the end of the header have to be decoded, with read_ahead more rows are decoded while the key is derived.
+int read_header(Image &image, const std::array<std::uint8_t, 32> &password, Header &header, std::uint8_t key[32], std::uint8_t iv[16], bool read_ahead, std::ostream &log, std::ostream &err);
+
+// Copies the name, accounting for the fact that there might be no null-terminator
+std::string header_name(const Header &header);
+
+// Decodes, decrypts and checks the embed, leaving it in data without its padding
+int extract(Image &image, const std::array<std::uint8_t, 32> &password, Header &header, std::vector<std::uint8_t> &data, std::ostream &log, std::ostream &err);
+
+// How encode_memory() embeds, the same defaults as the command line
+struct EncodeOptions {
+    Image::EncodingLevel level = Image::EncodingLevel::Low;
+    Image::PngProfile profile  = Image::PngProfile::Balanced;
+    std::string channels       = "all";
+    bool fec                   = false;
+    CoverCache *cache          = nullptr; // Decoded covers to reuse, none if null
+};
+
+// Embeds payload under name into a cover held in memory, in any format Image reads, and leaves the encoded image in out as a
+// PNG. Nothing touches the filesystem or prints progress, errors go to err. Returns 0, or -1 on failure.
+int encode_memory(const std::uint8_t *cover, std::size_t cover_size, const std::uint8_t *payload, std::size_t payload_size, const std::string &name,
+                  const std::array<std::uint8_t, 32> &password, const EncodeOptions &options, std::vector<std::uint8_t> &out, std::ostream &err);
+
+// Extracts the embed of an image held in memory into payload, and its name into name. Returns a DecodeResult, a shard of a
+// sharded embed is Corrupt on its own.
+int decode_memory(const std::uint8_t *data, std::size_t size, const std::array<std::uint8_t, 32> &password,
+                  std::vector<std::uint8_t> &payload, std::string &name, std::ostream &err);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // Zero threads means one per hardware thread
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool &operator=(const ThreadPool&) = delete;
+
+    // Queues a task to be run by one of the workers
+    void submit(std::function<void()> task);
+
+    // Calls fn(i) for each i in [0, count), the calling thread helps out and returns once all calls are done
+    void parallel_for(std::size_t count, const std::function<void(std::size_t)> &fn);
+
+    unsigned int size() const { return static_cast<unsigned int>(workers.size()); }
+
+    // Process-wide pool with one worker per hardware thread
+    static ThreadPool &shared();
+
+private:
+    void run();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+};
@@ -0,0 +1,86 @@
+#include "steganography.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Round-trips an embed through encode_memory() and decode_memory() at every level, with and without error correction.
+// Takes the path of a cover image.
+
+static const char *level_names[3] = { "Low", "Med", "High" };
+
+static std::vector<std::uint8_t> read_file(const char *path) {
+    std::ifstream file(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+static int round_trip(const std::vector<std::uint8_t> &cover, const std::vector<std::uint8_t> &payload, Image::EncodingLevel level, bool fec) {
+    auto password = hash_password("1234");
+    auto test = std::string(level_names[static_cast<int>(level)]) + (fec ? " with error correction" : "");
+
+    EncodeOptions options;
+    options.level   = level;
+    options.profile = Image::PngProfile::Fast;
+    options.fec     = fec;
+
+    std::vector<std::uint8_t> image;
+    if (encode_memory(cover.data(), cover.size(), payload.data(), payload.size(), "payload.bin", password, options, image, std::cerr) < 0) {
+        std::cerr << "FAIL: " << test << ": encode failed" << std::endl;
+        return -1;
+    }
+
+    std::vector<std::uint8_t> decoded;
+    std::string name;
+    auto result = decode_memory(image.data(), image.size(), password, decoded, name, std::cerr);
+    if (result != Decoded) {
+        std::cerr << "FAIL: " << test << ": decode returned " << result << std::endl;
+        return -1;
+    }
+
+    if (decoded != payload || name != "payload.bin") {
+        std::cerr << "FAIL: " << test << ": decoded embed doesn't match" << std::endl;
+        return -1;
+    }
+
+    // The wrong password must not get anything back, the error it reports is expected
+    std::ostream quiet(nullptr);
+    if (decode_memory(image.data(), image.size(), hash_password("4321"), decoded, name, quiet) != WrongPassword) {
+        std::cerr << "FAIL: " << test << ": decoded with the wrong password" << std::endl;
+        return -1;
+    }
+
+    std::cout << "ok: " << test << std::endl;
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: library_test <cover>" << std::endl;
+        return 2;
+    }
+
+    auto cover = read_file(argv[1]);
+    if (cover.empty()) {
+        std::cerr << "ERROR: Unable to read " << argv[1] << std::endl;
+        return 2;
+    }
+
+    // Small enough for the High level of a small cover
+    std::vector<std::uint8_t> payload(20000);
+    std::uint32_t state = 1;
+    for (auto &byte : payload) {
+        state = state * 1103515245 + 12345;
+        byte  = state >> 24;
+    }
+
+    int failed = 0;
+    for (auto level : { Image::EncodingLevel::Low, Image::EncodingLevel::Med, Image::EncodingLevel::High })
+        for (bool fec : { false, true })
+            failed += round_trip(cover, payload, level, fec) < 0;
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,300 @@
+#include "server.hpp"
+#include "steganography.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Runs a server in-process and talks to it over its socket. Built with SERVE_MAX_RESPONSE lowered to 1 MiB, so that a
+// response over the limit doesn't take gigabytes. Takes the path of a cover image.
+
+static const std::size_t max_connections = 2;
+
+struct Response {
+    std::uint8_t status;
+    std::vector<std::string> fields;
+};
+
+static std::vector<std::uint8_t> read_file(const char *path) {
+    std::ifstream file(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+// A PPM of random pixels, which doesn't compress so its PNG is about as big
+static std::vector<std::uint8_t> noise_ppm(unsigned int width, unsigned int height) {
+    auto header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+
+    std::vector<std::uint8_t> ppm(header.begin(), header.end());
+    ppm.resize(header.size() + std::size_t(width) * height * 3);
+
+    std::uint32_t state = 1;
+    for (auto i = header.size(); i < ppm.size(); i++) {
+        state  = state * 1103515245 + 12345;
+        ppm[i] = state >> 24;
+    }
+
+    return ppm;
+}
+
+static void put_u32(std::vector<std::uint8_t> &out, std::uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        out.push_back(value >> (i * 8));
+}
+
+static void put_field(std::vector<std::uint8_t> &out, const std::uint8_t *data, std::size_t size) {
+    put_u32(out, size);
+    out.insert(out.end(), data, data + size);
+}
+
+static void put_field(std::vector<std::uint8_t> &out, const std::string &str) {
+    put_field(out, reinterpret_cast<const std::uint8_t*>(str.data()), str.size());
+}
+
+static std::vector<std::uint8_t> encode_request(const std::vector<std::uint8_t> &cover, const std::string &payload) {
+    std::vector<std::uint8_t> body = { 1, 0, 1, 0 };
+    put_field(body, "1234");
+    put_field(body, cover.data(), cover.size());
+    put_field(body, "payload.txt");
+    put_field(body, "all");
+    put_field(body, payload);
+
+    return body;
+}
+
+static std::vector<std::uint8_t> decode_request(const std::vector<std::uint8_t> &image) {
+    std::vector<std::uint8_t> body = { 2, 0, 0, 0 };
+    put_field(body, "1234");
+    put_field(body, image.data(), image.size());
+
+    return body;
+}
+
+static int connect_to(const std::string &path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.data(), path.size());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address))) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool send_request(int fd, const std::vector<std::uint8_t> &body) {
+    std::vector<std::uint8_t> message;
+    put_u32(message, body.size());
+    message.insert(message.end(), body.begin(), body.end());
+
+    for (std::size_t sent = 0; sent < message.size();) {
+        auto count = ::send(fd, message.data() + sent, message.size() - sent, 0);
+        if (count <= 0)
+            return false;
+        sent += count;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *data, std::size_t size) {
+    auto *p = static_cast<std::uint8_t*>(data);
+
+    while (size) {
+        auto count = ::recv(fd, p, size, 0);
+        if (count <= 0)
+            return false;
+
+        p    += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+// Reads a response, fails if the connection closes first
+static bool read_response(int fd, Response &response) {
+    std::uint8_t prefix[4];
+    if (!read_all(fd, prefix, sizeof(prefix)))
+        return false;
+
+    std::vector<std::uint8_t> body(prefix[0] | (prefix[1] << 8) | (prefix[2] << 16) | (std::uint32_t(prefix[3]) << 24));
+    if (body.size() < 4 || !read_all(fd, body.data(), body.size()))
+        return false;
+
+    response.status = body[0];
+    response.fields.clear();
+
+    for (std::size_t pos = 4; pos + 4 <= body.size();) {
+        std::size_t size = body[pos] | (body[pos + 1] << 8) | (body[pos + 2] << 16) | (std::uint32_t(body[pos + 3]) << 24);
+        if (body.size() - pos - 4 < size)
+            return false;
+
+        response.fields.emplace_back(reinterpret_cast<const char*>(&body[pos + 4]), size);
+        pos += 4 + size;
+    }
+
+    return true;
+}
+
+static int fail(const std::string &test, const std::string &why) {
+    std::cerr << "FAIL: " << test << ": " << why << std::endl;
+    return -1;
+}
+
+// Connections past the limit are answered with a bad request
+static int test_max_connections(const std::string &path) {
+    const char *test = "max connections";
+
+    int open[max_connections];
+    for (auto &fd : open)
+        fd = connect_to(path);
+
+    int extra = connect_to(path);
+    Response response;
+    bool answered = extra >= 0 && read_response(extra, response);
+
+    for (auto fd : open)
+        ::close(fd);
+    ::close(extra);
+
+    // Let the server see the connections close before the next test
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    if (!answered)
+        return fail(test, "extra connection got no response");
+    if (response.status != 5 || response.fields.empty() || response.fields[0].find("Too many connections") == std::string::npos)
+        return fail(test, "extra connection got status " + std::to_string(response.status));
+
+    std::cout << "ok: " << test << std::endl;
+
+    return 0;
+}
+
+// A result too big for a response fails with a message, and the connection stays usable
+static int test_max_response(const std::string &path, const std::vector<std::uint8_t> &cover) {
+    const char *test = "max response";
+
+    // Something small enough to answer, to check the connection afterwards
+    std::vector<std::uint8_t> image;
+    EncodeOptions options;
+    options.profile = Image::PngProfile::Fast;
+
+    std::string payload = "a payload";
+    if (encode_memory(cover.data(), cover.size(), reinterpret_cast<const std::uint8_t*>(payload.data()), payload.size(), "payload.txt",
+                      hash_password("1234"), options, image, std::cerr) < 0)
+        return fail(test, "encode of the small image failed");
+
+    int fd = connect_to(path);
+    Response big, small;
+    bool answered = fd >= 0 && send_request(fd, encode_request(noise_ppm(1024, 1024), payload)) && read_response(fd, big) &&
+                    send_request(fd, decode_request(image)) && read_response(fd, small);
+    ::close(fd);
+
+    if (!answered)
+        return fail(test, "connection closed without a response");
+    if (big.status != 4 || big.fields.size() != 1 || big.fields[0].find("over the limit") == std::string::npos)
+        return fail(test, "oversized response got status " + std::to_string(big.status));
+    if (small.status != 0 || small.fields.size() != 3 || small.fields[2] != payload)
+        return fail(test, "request after it got status " + std::to_string(small.status));
+
+    std::cout << "ok: " << test << std::endl;
+
+    return 0;
+}
+
+// A request read before the server is stopped is still answered
+static int test_stop(const std::string &path, std::thread &server) {
+    const char *test = "stop";
+
+    int fd = connect_to(path);
+    bool sent = fd >= 0 && send_request(fd, encode_request(noise_ppm(3000, 3000), "a payload"));
+
+    // Long enough for the request to be queued, the encode of 27 MB of noise takes much longer. The signal goes to the
+    // thread waiting for connections, so that it stops straight away.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    pthread_kill(server.native_handle(), SIGTERM);
+
+    if (!sent) {
+        ::close(fd);
+        return fail(test, "unable to send the request");
+    }
+
+    Response response;
+    bool answered = read_response(fd, response);
+    ::close(fd);
+
+    if (!answered)
+        return fail(test, "connection closed without a response");
+    if (response.status != 4)
+        return fail(test, "got status " + std::to_string(response.status));
+
+    std::cout << "ok: " << test << std::endl;
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: server_test <cover>" << std::endl;
+        return 2;
+    }
+
+    auto cover = read_file(argv[1]);
+    if (cover.empty()) {
+        std::cerr << "ERROR: Unable to read " << argv[1] << std::endl;
+        return 2;
+    }
+
+    char dir[] = "/tmp/server_test.XXXXXX";
+    if (!::mkdtemp(dir)) {
+        std::cerr << "ERROR: Unable to make a directory for the socket" << std::endl;
+        return 2;
+    }
+
+    auto path = std::string(dir) + "/sock";
+
+    int served = -1;
+    std::thread server([&]() {
+        served = serve(path, 1, 2, 256 * 1024 * 1024, max_connections, 0);
+    });
+
+    // Wait for it to listen
+    for (int i = 0; i < 100; i++) {
+        int fd = connect_to(path);
+        if (fd >= 0) {
+            ::close(fd);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    // The probe above takes up a connection until the server sees it close
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    int failed = 0;
+    failed += test_max_connections(path) < 0;
+    failed += test_max_response(path, cover) < 0;
+    failed += test_stop(path, server) < 0;
+
+    server.join();
+    ::rmdir(dir);
+
+    if (served < 0)
+        failed++;
+
+    return failed ? 1 : 0;
+}